@@ -0,0 +1,19 @@
+; Making and calling closures, and set! on captured variables.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+
+(define compose (lambda (f g) (lambda (x) (f (g x)))))
+
+(define make-counter (lambda ()
+  (define count 0)
+  (lambda () (set! count (+ count 1)) count)))
+
+(define run (lambda (i counter ok)
+  (if (eqv? i 0) ok
+      (run (+ i -1) counter
+           (if ok (eqv? ((compose (make-adder i) (make-adder 1)) (counter))
+                        200002)
+               #f)))))
+
+(check (run 200000 (make-counter) #t))
@@ -0,0 +1,9 @@
+; Doubly recursive fib: calls and fixnum arithmetic.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define fib (lambda (n)
+  (if (eqv? n 0) 0
+      (if (eqv? n 1) 1
+          (+ (fib (+ n -1)) (fib (+ n -2)))))))
+
+(check (eqv? (fib 27) 196418))
@@ -0,0 +1,19 @@
+; Building, reversing and walking lists: pair allocation and the gc.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define iota (lambda (n acc)
+  (if (eqv? n 0) acc (iota (+ n -1) (cons n acc)))))
+
+(define reverse (lambda (l acc)
+  (if (null? l) acc (reverse (cdr l) (cons (car l) acc)))))
+
+(define sum (lambda (l acc)
+  (if (null? l) acc (sum (cdr l) (+ acc (car l))))))
+
+(define run (lambda (times ok)
+  (if (eqv? times 0) ok
+      (run (+ times -1)
+           (if ok (eqv? (sum (reverse (iota 50000 '()) '()) 0) 1250025000)
+               #f)))))
+
+(check (run 40 #t))
@@ -0,0 +1,12 @@
+; Numeric vectors: bulk kernels over raw f64 and s32 elements.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define v (make-f64vector 1000000 0.5))
+(define s (make-s32vector 1000000 3))
+(define loop (lambda (n acc)
+  (if (< 0 n)
+      (loop (- n 1) (+ acc (f64vector-dot v v) (s32vector-sum s)
+                        (s32vector-max (s32vector-add s s))))
+      acc)))
+
+(check (= (loop 20 0) (* 20 (+ 250000.0 3000000 6))))
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Runs each bench/*.scm a few times and reports the best wall time, the
+# cells allocated and the peak heap, next to the numbers in
+# bench/baseline. With --baseline, writes them to bench/baseline instead.
+#
+# RUNS sets the number of runs (5 by default), SKETCH the binary. Other
+# options go in the environment, e.g. SKETCH_TREE_WALK=1.
+
+dir=$(dirname "$0")
+sketch=${SKETCH:-$dir/../sketch}
+runs=${RUNS:-5}
+baseline=$dir/baseline
+writing=
+if [ "$1" = "--baseline" ]; then writing=1; : > "$baseline.new"; fi
+
+# percent change from $1 to $2
+change() {
+  awk -v old="$1" -v new="$2" 'BEGIN {
+    if (old == "" || old == 0) print "-";
+    else printf "%+.1f%%", (new-old)*100/old }'
+}
+
+printf "%-10s %10s %8s %12s %8s %12s %8s\n" \
+  bench "ms" "" cells "" "peak heap" ""
+status=0
+for file in "$dir"/*.scm; do
+  name=$(basename "$file" .scm)
+  best=
+  i=0
+  while [ $i -lt "$runs" ]; do
+    start=$(date +%s%N)
+    if ! "$sketch" --stats "$file" >/dev/null 2>"$dir/stats.tmp"; then
+      echo "$name: failed" >&2
+      cat "$dir/stats.tmp" >&2
+      status=1
+      continue 2
+    fi
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    if [ -z "$best" ] || [ $ms -lt $best ]; then best=$ms; fi
+    i=$((i+1))
+  done
+  cells=$(sed -n 's/^cells allocated: //p' "$dir/stats.tmp")
+  peak=$(sed -n 's/^peak heap: \([0-9]*\) bytes/\1/p' "$dir/stats.tmp")
+
+  set -- $(grep "^$name " "$baseline" 2>/dev/null)
+  printf "%-10s %10s %8s %12s %8s %12s %8s\n" "$name" \
+    "$best" "$(change "$2" $best)" \
+    "$cells" "$(change "$3" $cells)" \
+    "$peak" "$(change "$4" $peak)"
+  [ -n "$writing" ] && echo "$name $best $cells $peak" >> "$baseline.new"
+done
+rm -f "$dir/stats.tmp"
+[ -n "$writing" ] && [ $status = 0 ] && mv "$baseline.new" "$baseline"
+rm -f "$baseline.new"
+exit $status
@@ -0,0 +1,21 @@
+; Strings: a builder filled in a loop, then searched and compared.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define sb (make-string-builder))
+(define fill (lambda (n)
+  (if (< 0 n)
+      ((lambda ()
+         (string-builder-append! sb "lorem ipsum dolor sit amet " #\;)
+         (fill (- n 1))))
+      0)))
+(fill 100000)
+(string-builder-append! sb "needle")
+(define s (string-builder->string sb))
+
+(define search (lambda (n acc)
+  (if (< 0 n)
+      (search (- n 1) (+ acc (string-contains s "needle")
+                         (string-index s #\;)))
+      acc)))
+(check (= (search 50 0) (* 50 (+ 2800000 27))))
+(check (string=? (substring s 0 5) "lorem"))
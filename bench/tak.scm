@@ -0,0 +1,9 @@
+; Takeuchi's function: calls, comparisons and subtraction on fixnums.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define tak (lambda (x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))
+      z)))
+
+(check (= (tak 22 16 8) 9))
@@ -0,0 +1,18 @@
+; Walking a vector by index.
+(define check (lambda (ok) ((if ok (lambda () ok) #f))))
+
+(define iota (lambda (n acc)
+  (if (eqv? n 0) acc (iota (+ n -1) (cons n acc)))))
+
+(define v (list->vector (iota 10000 '())))
+
+(define vsum (lambda (v i n acc)
+  (if (eqv? i n) acc
+      (vsum v (+ i 1) n (+ acc (vector-ref v i))))))
+
+(define run (lambda (times ok)
+  (if (eqv? times 0) ok
+      (run (+ times -1)
+           (if ok (eqv? (vsum v 0 (vector-length v) 0) 50005000) #f)))))
+
+(check (run 200 #t))
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Bignums: integers too big for T_INT32. On the heap, a T_BIG is its
+   magnitude in 32-bit digits, least significant first, with the sign
+   in the header (see common.h). An integer that fits in 32 bits is
+   never a bignum, so two equal integers always have the same type.
+
+   Arithmetic works on copies in malloc()ed memory, struct big, and only
+   the result goes back on the heap; so nothing moves halfway, and the
+   arguments of a builtin can be read as it goes along. */
+
+struct big {
+  uint32_t *d;   /* digits, least significant first */
+  uint32_t len;  /* without leading zeros, so 0 for zero */
+  int neg;
+};
+
+/* products of operands this many digits or longer are split in halves
+   (Karatsuba); below it, schoolbook multiplication is faster */
+#define KARATSUBA_MIN 32
+
+static uint32_t *alloc_digits(uint32_t len) {
+  uint32_t *d = calloc(len ? len : 1, sizeof(uint32_t));
+  if (d == 0) die("couldn't alloc memory for a bignum");
+  return d;
+}
+
+static uint32_t trim(const uint32_t *d, uint32_t len) {
+  while (len > 0 && d[len-1] == 0) len--;
+  return len;
+}
+
+static void big_from_int64(struct big *b, int64_t n) {
+  uint64_t mag = n < 0 ? -(uint64_t)n : (uint64_t)n;
+  b->d = alloc_digits(2);
+  b->d[0] = (uint32_t)mag;
+  b->d[1] = (uint32_t)(mag >> 32);
+  b->len = trim(b->d, 2);
+  b->neg = n < 0;
+}
+
+/* index must be a T_INT32 or a T_BIG */
+static void big_from_value(struct big *b, uint32_t index) {
+  if (TYPE(index) == T_INT32) {
+    big_from_int64(b, INT32_VALUE(index));
+    return;
+  }
+  b->len = BIG_LEN(index);
+  b->d = alloc_digits(b->len);
+  memcpy(b->d, BIG_DIGITS(index), b->len*sizeof(uint32_t));
+  b->neg = (cells[index] & BIG_NEGATIVE) != 0;
+}
+
+/* Stores b on the heap as a T_INT32 if it fits, else a T_BIG, and
+   frees its digits. */
+static uint32_t store_big(struct big *b) {
+  uint32_t len = trim(b->d, b->len);
+  if (len <= 1) {
+    int64_t n = len ? b->d[0] : 0;
+    if (b->neg) n = -n;
+    if (n >= INT32_MIN && n <= INT32_MAX) {
+      free(b->d);
+      return store_int32((int32_t)n);
+    }
+  }
+  uint32_t size = CELLS_EVEN(1 + (len+1)/2);
+  CHECK_CELLS(size);
+  STAT(stats.cells[T_BIG] += size);
+  if (alloc_profiling) profile_alloc(ALLOC_INTEGER, size);
+  uint32_t index = next_cell;
+  cells[index] = T_BIG | (b->neg ? BIG_NEGATIVE : 0) | (uint64_t)len << 32;
+  cells[index+size-1] = 0;  /* the padding, if any */
+  memcpy(BIG_DIGITS(index), b->d, len*sizeof(uint32_t));
+  next_cell += size;
+  free(b->d);
+  return index;
+}
+
+uint32_t store_int64(int64_t num) {
+  struct big b;
+  big_from_int64(&b, num);
+  return store_big(&b);
+}
+
+/* from len digits anywhere, even not trimmed */
+uint32_t store_bignum(const uint32_t *digits, uint32_t len, int negative) {
+  struct big b;
+  b.d = alloc_digits(len);
+  memcpy(b.d, digits, len*sizeof(uint32_t));
+  b.len = len;
+  b.neg = negative;
+  return store_big(&b);
+}
+
+/* Magnitudes. Results go in r, which has room for them; lengths are
+   as given, zeros and all, unless they say otherwise. */
+
+static int mag_compare(const uint32_t *a, uint32_t an,
+                       const uint32_t *b, uint32_t bn) {
+  an = trim(a, an); bn = trim(b, bn);
+  if (an != bn) return an < bn ? -1 : 1;
+  for (uint32_t i = an; i > 0; i--)
+    if (a[i-1] != b[i-1]) return a[i-1] < b[i-1] ? -1 : 1;
+  return 0;
+}
+
+/* r = a + b, with an >= bn; r has an+1 digits */
+static void mag_add(uint32_t *r, const uint32_t *a, uint32_t an,
+                    const uint32_t *b, uint32_t bn) {
+  uint64_t carry = 0;
+  for (uint32_t i = 0; i < an; i++) {
+    carry += (uint64_t)a[i] + (i < bn ? b[i] : 0);
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  r[an] = (uint32_t)carry;
+}
+
+/* r = a - b, with a >= b and an >= bn; r has an digits */
+static void mag_sub(uint32_t *r, const uint32_t *a, uint32_t an,
+                    const uint32_t *b, uint32_t bn) {
+  int64_t borrow = 0;
+  for (uint32_t i = 0; i < an; i++) {
+    borrow += (int64_t)a[i] - (i < bn ? b[i] : 0);
+    r[i] = (uint32_t)borrow;
+    borrow >>= 32;  /* 0 or -1 */
+  }
+}
+
+/* r += a, where r has rn digits and the sum fits */
+static void add_into(uint32_t *r, uint32_t rn, const uint32_t *a,
+                     uint32_t an) {
+  uint64_t carry = 0;
+  for (uint32_t i = 0; i < rn && (i < an || carry); i++) {
+    carry += (uint64_t)r[i] + (i < an ? a[i] : 0);
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+/* r -= a, where r has rn digits and r >= a */
+static void sub_from(uint32_t *r, uint32_t rn, const uint32_t *a,
+                     uint32_t an) {
+  int64_t borrow = 0;
+  for (uint32_t i = 0; i < rn && (i < an || borrow); i++) {
+    borrow += (int64_t)r[i] - (i < an ? a[i] : 0);
+    r[i] = (uint32_t)borrow;
+    borrow >>= 32;
+  }
+}
+
+/* d = d / div, in place; returns the remainder */
+static uint32_t div_small(uint32_t *d, uint32_t len, uint32_t div) {
+  uint64_t rem = 0;
+  for (uint32_t i = len; i > 0; i--) {
+    rem = rem << 32 | d[i-1];
+    d[i-1] = (uint32_t)(rem / div);
+    rem %= div;
+  }
+  return (uint32_t)rem;
+}
+
+/* q = u / v and r = u % v, with un >= vn >= 2 and v[vn-1] not zero; q
+   has un-vn+1 digits, r has vn. This is Knuth's algorithm D: long
+   division, guessing each digit of q from the top two digits of what's
+   left and the top one of v, after shifting both so that v's top bit
+   is set, which makes the guess at most 2 too big. */
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *u,
+                       uint32_t un, const uint32_t *v, uint32_t vn) {
+  int s = __builtin_clz(v[vn-1]);
+  uint32_t *nv = alloc_digits(vn), *nu = alloc_digits(un+1);
+  for (uint32_t i = vn-1; i > 0; i--)
+    nv[i] = v[i] << s | (s ? v[i-1] >> (32-s) : 0);
+  nv[0] = v[0] << s;
+  nu[un] = s ? u[un-1] >> (32-s) : 0;
+  for (uint32_t i = un-1; i > 0; i--)
+    nu[i] = u[i] << s | (s ? u[i-1] >> (32-s) : 0);
+  nu[0] = u[0] << s;
+
+  for (uint32_t j = un-vn+1; j > 0; j--) {
+    uint32_t *w = nu + j-1;  /* what's left, at the digit being found */
+    uint64_t top = (uint64_t)w[vn] << 32 | w[vn-1];
+    uint64_t qhat = top / nv[vn-1], rhat = top % nv[vn-1];
+    while (qhat >> 32 ||
+           qhat*nv[vn-2] > (rhat << 32 | w[vn-2])) {
+      qhat--;
+      rhat += nv[vn-1];
+      if (rhat >> 32) break;
+    }
+    /* w -= qhat * nv */
+    int64_t borrow = 0, t;
+    for (uint32_t i = 0; i < vn; i++) {
+      uint64_t p = qhat * nv[i];
+      t = (int64_t)w[i] - borrow - (int64_t)(p & 0xFFFFFFFF);
+      w[i] = (uint32_t)t;
+      borrow = (int64_t)(p >> 32) - (t >> 32);
+    }
+    t = (int64_t)w[vn] - borrow;
+    w[vn] = (uint32_t)t;
+    if (t < 0) {  /* one too many after all: add nv back */
+      qhat--;
+      uint64_t carry = 0;
+      for (uint32_t i = 0; i < vn; i++) {
+        carry += (uint64_t)w[i] + nv[i];
+        w[i] = (uint32_t)carry;
+        carry >>= 32;
+      }
+      w[vn] += (uint32_t)carry;
+    }
+    q[j-1] = (uint32_t)qhat;
+  }
+  for (uint32_t i = 0; i < vn; i++)
+    r[i] = nu[i] >> s | (s ? (uint32_t)((uint64_t)nu[i+1] << (32-s)) : 0);
+  free(nv); free(nu);
+}
+
+/* r = a * b; r has an+bn digits */
+static void mul_schoolbook(uint32_t *r, const uint32_t *a, uint32_t an,
+                           const uint32_t *b, uint32_t bn) {
+  memset(r, 0, (an+bn)*sizeof(uint32_t));
+  for (uint32_t i = 0; i < an; i++) {
+    uint64_t carry = 0;
+    for (uint32_t j = 0; j < bn; j++) {
+      carry += (uint64_t)a[i]*b[j] + r[i+j];
+      r[i+j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r[i+bn] = (uint32_t)carry;
+  }
+}
+
+static void mul_karatsuba(uint32_t *r, const uint32_t *a, uint32_t an,
+                          const uint32_t *b, uint32_t bn);
+
+/* r = a * b, with an >= bn; r has an+bn digits */
+static void mag_mul(uint32_t *r, const uint32_t *a, uint32_t an,
+                    const uint32_t *b, uint32_t bn) {
+  if (bn < KARATSUBA_MIN) {
+    mul_schoolbook(r, a, an, b, bn);
+  } else if (bn <= an/2) {
+    /* lopsided: b times each bn-digit piece of a, added at its place */
+    uint32_t *part = alloc_digits(2*bn);
+    memset(r, 0, (an+bn)*sizeof(uint32_t));
+    for (uint32_t i = 0; i < an; i += bn) {
+      uint32_t n = an-i < bn ? an-i : bn;
+      if (n >= bn) mag_mul(part, a+i, n, b, bn);
+      else mag_mul(part, b, bn, a+i, n);
+      add_into(r+i, an+bn-i, part, n+bn);
+    }
+    free(part);
+  } else {
+    mul_karatsuba(r, a, an, b, bn);
+  }
+}
+
+/* With a = a1*B^m + a0 and b = b1*B^m + b0, where B is 2^32,
+   a*b = z2*B^2m + z1*B^m + z0, with z0 = a0*b0, z2 = a1*b1 and
+   z1 = (a0+a1)(b0+b1) - z0 - z2: three half-size products, not four.
+   Here an >= bn > an/2, so b1 isn't empty. */
+static void mul_karatsuba(uint32_t *r, const uint32_t *a, uint32_t an,
+                          const uint32_t *b, uint32_t bn) {
+  uint32_t m = an/2;
+  const uint32_t *a0 = a, *a1 = a+m, *b0 = b, *b1 = b+m;
+  uint32_t a1n = an-m, b1n = bn-m;  /* a1n >= m, a1n >= b1n */
+
+  /* z0 and z2 go straight to where they belong in r */
+  memset(r, 0, (an+bn)*sizeof(uint32_t));
+  mag_mul(r, a0, m, b0, m);
+  mag_mul(r+2*m, a1, a1n, b1, b1n);
+
+  /* the sums have at most a1n+1 digits each */
+  uint32_t *sa = alloc_digits(a1n+1), *sb = alloc_digits(a1n+1);
+  mag_add(sa, a1, a1n, a0, m);
+  if (b1n >= m) mag_add(sb, b1, b1n, b0, m);
+  else mag_add(sb, b0, m, b1, b1n);
+  uint32_t san = trim(sa, a1n+1), sbn = trim(sb, a1n+1);
+  uint32_t z1n = san+sbn;
+  uint32_t *z1 = alloc_digits(z1n + 1);
+  if (san >= sbn) mag_mul(z1, sa, san, sb, sbn);
+  else mag_mul(z1, sb, sbn, sa, san);
+  sub_from(z1, z1n, r, 2*m);
+  sub_from(z1, z1n, r+2*m, a1n+b1n);
+  add_into(r+m, an+bn-m, z1, trim(z1, z1n));
+  free(sa); free(sb); free(z1);
+}
+
+/* Signed arithmetic. */
+
+/* a = a + b */
+static void big_add(struct big *a, const struct big *b) {
+  uint32_t len = (a->len > b->len ? a->len : b->len) + 1;
+  uint32_t *r = alloc_digits(len);
+  if (a->neg == b->neg) {
+    if (a->len >= b->len) mag_add(r, a->d, a->len, b->d, b->len);
+    else mag_add(r, b->d, b->len, a->d, a->len);
+  } else if (mag_compare(a->d, a->len, b->d, b->len) >= 0) {
+    mag_sub(r, a->d, a->len, b->d, b->len);
+  } else {
+    mag_sub(r, b->d, b->len, a->d, a->len);
+    a->neg = b->neg;
+  }
+  free(a->d);
+  a->d = r;
+  a->len = trim(r, len);
+  if (a->len == 0) a->neg = 0;
+}
+
+/* a = a * b */
+static void big_mul(struct big *a, const struct big *b) {
+  uint32_t len = a->len + b->len;
+  uint32_t *r = alloc_digits(len);
+  if (a->len == 0 || b->len == 0) len = 0;
+  else if (a->len >= b->len) mag_mul(r, a->d, a->len, b->d, b->len);
+  else mag_mul(r, b->d, b->len, a->d, a->len);
+  free(a->d);
+  a->d = r;
+  a->neg = a->neg != b->neg;
+  a->len = trim(r, len);
+  if (a->len == 0) a->neg = 0;
+}
+
+static double digits_to_double(const uint32_t *d, uint32_t len, int neg) {
+  double res = 0;
+  for (uint32_t i = len; i > 0; i--) res = res*4294967296.0 + d[i-1];
+  return neg ? -res : res;
+}
+
+double bignum_to_double(uint32_t index) {
+  return digits_to_double(BIG_DIGITS(index), BIG_LEN(index),
+                          (cells[index] & BIG_NEGATIVE) != 0);
+}
+
+/* The rest of a sum, difference or product (see arith() in builtins.c)
+   from argument i on, once it no longer fits in 32 bits or has a bignum
+   in it: start is the total so far. A flonum makes the rest flonum
+   arithmetic. */
+uint32_t bignum_arith(int32_t start, const uint32_t *args, uint32_t nargs,
+                      uint32_t i, int op) {
+  struct big accum, arg;
+  big_from_int64(&accum, start);
+  for (; i < nargs; i++) {
+    if (TYPE(args[i]) == T_FLO) {
+      double start = digits_to_double(accum.d, accum.len, accum.neg);
+      free(accum.d);
+      return flonum_arith(start, args, nargs, i, op);
+    }
+    if (TYPE(args[i]) != T_INT32 && TYPE(args[i]) != T_BIG) {
+      free(accum.d);
+      return 0;
+    }
+    big_from_value(&arg, args[i]);
+    if (SUBTRACTS(op, i, nargs) && arg.len) arg.neg = !arg.neg;
+    if (op == '*') big_mul(&accum, &arg);
+    else big_add(&accum, &arg);
+    free(arg.d);
+  }
+  return store_big(&accum);
+}
+
+int bignum_eqv(uint32_t a, uint32_t b) {
+  return BIG_LEN(a) == BIG_LEN(b) &&
+         (cells[a] & BIG_NEGATIVE) == (cells[b] & BIG_NEGATIVE) &&
+         memcmp(BIG_DIGITS(a), BIG_DIGITS(b),
+                BIG_LEN(a)*sizeof(uint32_t)) == 0;
+}
+
+/* -1, 0 or 1 as a is less than, equal to or greater than b, both
+   integers */
+int bignum_compare(uint32_t a, uint32_t b) {
+  struct big x, y;
+  big_from_value(&x, a);
+  big_from_value(&y, b);
+  int res;
+  if (x.neg != y.neg) res = x.neg ? -1 : 1;
+  else res = mag_compare(x.d, x.len, y.d, y.len) * (x.neg ? -1 : 1);
+  free(x.d); free(y.d);
+  return res;
+}
+
+/* The quotient of a and b, both integers, or with remainder set the
+   remainder. b mustn't be zero. Division truncates, so the remainder
+   has a's sign. */
+uint32_t bignum_divide(uint32_t a, uint32_t b, int remainder) {
+  struct big x, y, q, r;
+  big_from_value(&x, a);
+  big_from_value(&y, b);
+  q.d = alloc_digits(x.len); q.len = x.len; q.neg = x.neg != y.neg;
+  r.d = alloc_digits(y.len); r.len = y.len; r.neg = x.neg;
+  if (mag_compare(x.d, x.len, y.d, y.len) < 0) {
+    memcpy(r.d, x.d, x.len*sizeof(uint32_t));
+    q.len = 0;
+  } else if (y.len == 1) {
+    memcpy(q.d, x.d, x.len*sizeof(uint32_t));
+    r.d[0] = div_small(q.d, x.len, y.d[0]);
+  } else {
+    mag_divmod(q.d, r.d, x.d, x.len, y.d, y.len);
+  }
+  free(x.d); free(y.d);
+  if (remainder) {
+    free(q.d);
+    return store_big(&r);
+  }
+  free(r.d);
+  return store_big(&q);
+}
+
+/* Decimal. Conversions go 9 digits at a time, as 10^9 fits a digit. */
+
+#define CHUNK 1000000000u
+#define CHUNK_DIGITS 9
+
+/* d = d*mul + add, in place; returns the new length */
+static uint32_t mul_add_small(uint32_t *d, uint32_t len, uint32_t mul,
+                              uint32_t add) {
+  uint64_t carry = add;
+  for (uint32_t i = 0; i < len; i++) {
+    carry += (uint64_t)d[i]*mul;
+    d[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry) d[len++] = (uint32_t)carry;
+  return len;
+}
+
+/* for the reader: len decimal digits, any size */
+uint32_t read_bignum(const char *digits, uint32_t len, int negative) {
+  struct big b;
+  /* each chunk of 9 decimal digits takes at most one of ours */
+  b.d = alloc_digits(len/CHUNK_DIGITS + 2);
+  b.len = 0;
+  b.neg = negative;
+  for (uint32_t i = 0; i < len; ) {
+    uint32_t n = (len-i) % CHUNK_DIGITS ? (len-i) % CHUNK_DIGITS
+                                        : CHUNK_DIGITS;
+    uint32_t chunk = 0, mul = 1;
+    for (uint32_t j = 0; j < n; j++, i++) {
+      chunk = chunk*10 + (digits[i] - '0');
+      mul *= 10;
+    }
+    b.len = mul_add_small(b.d, b.len, mul, chunk);
+  }
+  b.len = trim(b.d, b.len);
+  if (b.len == 0) b.neg = 0;
+  return store_big(&b);
+}
+
+void print_bignum(uint32_t index) {
+  uint32_t len = BIG_LEN(index);
+  uint32_t *d = alloc_digits(len);
+  memcpy(d, BIG_DIGITS(index), len*sizeof(uint32_t));
+  /* base 10^9 chunks, least significant first */
+  uint32_t *chunks = alloc_digits(len*10/9 + 2), num_chunks = 0;
+  while (len > 0) {
+    chunks[num_chunks++] = div_small(d, len, CHUNK);
+    len = trim(d, len);
+  }
+  if (cells[index] & BIG_NEGATIVE) putchar('-');
+  printf("%u", chunks[num_chunks-1]);
+  for (uint32_t i = num_chunks-1; i > 0; i--) printf("%09u", chunks[i-1]);
+  free(d); free(chunks);
+}
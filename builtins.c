@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
@@ -7,40 +8,116 @@
    lots of internal structure in sketch.c deliberately exposed
    via common.h. */
 
-void register_builtin(char *name, builtin_t func) {
+static const char *builtin_names[MAX_BUILTINS];
+static uint32_t num_builtins = 0;
+
+/* Each builtin's function, and where its T_FUNC is on the heap, kept up
+   to date by the gc. An image (see image.c) saves the latter as its
+   relocation table: the function pointers it has are the saving
+   process's, and get replaced by ours. */
+static builtin_t builtin_funcs[MAX_BUILTINS];
+static uint32_t builtin_cells[MAX_BUILTINS];
+
+static void visit_builtins(void (*visit)(uint32_t *)) {
+  for (uint32_t i = 0; i < num_builtins; i++) visit(&builtin_cells[i]);
+}
+
+uint32_t *builtin_locations(void) {
+  return builtin_cells;
+}
+
+/* 0 if a location isn't the builtin it should be */
+int relocate_builtins(const uint32_t *locations) {
+  for (uint32_t i = 0; i < num_builtins; i++) {
+    uint32_t index = locations[i];
+    if (index >= next_cell || IMMEDIATE(index) || TYPE(index) != T_FUNC ||
+        !(cells[index] & BLTIN_MASK) || BLTIN_ID(index) != i)
+      return 0;
+  }
+  for (uint32_t i = 0; i < num_builtins; i++) {
+    builtin_cells[i] = locations[i];
+    cells[locations[i]+1] = (uint64_t)(uintptr_t)builtin_funcs[i];
+  }
+  return 1;
+}
+
+uint32_t builtin_count(void) {
+  return num_builtins;
+}
+
+const char *builtin_name(uint32_t id) {
+  return builtin_names[id];
+}
+
+/* returns the global it's bound to */
+uint32_t register_builtin(char *name, builtin_t func, uint32_t min_args,
+                          uint32_t max_args) {
+  if (num_builtins == MAX_BUILTINS) die("too many builtins");
   CHECK_CELLS(2);
+  STAT(stats.cells[T_FUNC] += 2);
   uint64_t value = T_FUNC | BLTIN_MASK;
+  value |= (uint64_t)num_builtins << 16;
+  value |= (uint64_t)max_args << 32;
+  value |= (uint64_t)min_args << 48;
+  builtin_names[num_builtins] = name;
+  builtin_funcs[num_builtins] = func;
+  builtin_cells[num_builtins++] = next_cell;
   uint32_t index = next_cell;
   cells[next_cell++] = value;
   cells[next_cell++] = (uint64_t)(uintptr_t)func;
 
   uint32_t slot, frame;
   add_symbol(name, strlen(name), &slot, &frame);
-  store_env(toplevel_env, slot, index);
+  reserve_globals(slot+1);
+  globals[slot] = index;
+  return slot;
 }
 
-/* Every builtin gets an index to a list of all its arguments. If it
-   receives just one, it's still a list of one, e.g. ((1 2)) for (car '(1 2)).
-   Return value is the index of the result, or 0 if an error occurs.
-   Because the list of arguments is built up as they're evaluated, builtins
-   can assume it's a well-formed list. */
+/* The primitives (see C_ADD in common.h), by form: which builtin each
+   one is, and the global that's bound to it until someone redefines it. */
+static uint32_t primitive_ids[NUM_PRIMITIVES];
+static uint32_t primitive_slots[NUM_PRIMITIVES];
 
-/* some handy defines for functions expecting one or two arguments and
-   wishing to fail if the number of arguments doesn't match. */
+static void register_primitive(uint32_t form, char *name, builtin_t func,
+                               uint32_t min_args, uint32_t max_args) {
+  primitive_ids[form - FIRST_PRIMITIVE] = num_builtins;
+  primitive_slots[form - FIRST_PRIMITIVE] =
+    register_builtin(name, func, min_args, max_args);
+}
 
-#define ONE_ARG(name) uint32_t name; if (!check_list(args, 1, 1)) \
-  return 0; name = CAR(args);
+uint32_t primitive_slot(uint32_t form) {
+  return primitive_slots[form - FIRST_PRIMITIVE];
+}
+
+/* whether the primitive's global is still bound to its builtin */
+int primitive_intact(uint32_t form) {
+  uint32_t i = form - FIRST_PRIMITIVE;
+  return globals[primitive_slots[i]] == builtin_cells[primitive_ids[i]];
+}
 
-#define TWO_ARGS(name1, name2) uint32_t name1, name2; \
-  if (!check_list(args, 2, 1)) return 0; name1 = CAR(args); \
-  name2 = CAR(CDR(args));
+/* the primitive a call of the global in slot can be, or -1 */
+int primitive_of(uint32_t slot) {
+  for (uint32_t form = FIRST_PRIMITIVE;
+       form < FIRST_PRIMITIVE + NUM_PRIMITIVES; form++)
+    if (primitive_slot(form) == slot)
+      return primitive_intact(form) ? (int)form : -1;
+  return -1;
+}
+
+/* Every builtin gets a pointer to its evaluated arguments and their
+   number, which is within the arity it was registered with, so it
+   doesn't need to check. Return value is the index of the result, or 0
+   if an error occurs.
+
+   The arguments are rooted and kept up to date by the gc, so a builtin
+   can allocate and then read them again; but the array may move if the
+   builtin calls back into the evaluator. */
 
 /* Types. */
 
 #define GEN_TYPE_PREDICATE(func_name, type) \
-  uint32_t func_name(uint32_t args) { \
-    ONE_ARG(name); \
-    if (TYPE(name) == type) return C_TRUE; \
+  uint32_t func_name(const uint32_t *args, uint32_t nargs) { \
+    if (TYPE(args[0]) == type) return C_TRUE; \
     else return C_FALSE; \
   }
 
@@ -51,23 +128,26 @@ GEN_TYPE_PREDICATE(symbol_p, T_SYM)
 GEN_TYPE_PREDICATE(char_p, T_CHAR)
 GEN_TYPE_PREDICATE(pair_p, T_PAIR)
 
-/* TODO: richer number types will change this */
-GEN_TYPE_PREDICATE(number_p, T_INT32)
+uint32_t number_p(const uint32_t *args, uint32_t nargs) {
+  uint32_t type = TYPE(args[0]);
+  if (type == T_INT32 || type == T_BIG || type == T_FLO) return C_TRUE;
+  else return C_FALSE;
+}
 
-uint32_t boolean_p(uint32_t args) {
-  ONE_ARG(index);
+uint32_t boolean_p(const uint32_t *args, uint32_t nargs) {
+  uint32_t index = args[0];
   if (index == C_TRUE || index == C_FALSE) return C_TRUE;
   else return C_FALSE;
 }
 
-uint32_t null_p(uint32_t args) {
-  ONE_ARG(index);
+uint32_t null_p(const uint32_t *args, uint32_t nargs) {
+  uint32_t index = args[0];
   if (index == C_EMPTY) return C_TRUE;
   else return C_FALSE;
 }
 
-uint32_t list_p(uint32_t args) {
-  ONE_ARG(list);
+uint32_t list_p(const uint32_t *args, uint32_t nargs) {
+  uint32_t list = args[0];
   if (check_list(list, 0, 0)) return C_TRUE;
   else return C_FALSE;
 }
@@ -76,14 +156,14 @@ uint32_t list_p(uint32_t args) {
 
 /* a helper function to make it easier to call this from other builtins */
 uint32_t eqv_pair(uint32_t arg1, uint32_t arg2) {
-  uint32_t len1, len2;
   if (arg1 == arg2) return C_TRUE;
   if (TYPE(arg1) != TYPE(arg2)) return C_FALSE;
   switch(TYPE(arg1)) {
     case T_STR:
     case T_PAIR:
     case T_VECT:
-      /* these are equal only if they're identical */
+    case T_SYM:
+      /* these are equal only if they're identical; symbols are interned */
     case T_FUNC:
       /* probably the right behavior. TODO: reevaluate when closures work. */
     case T_RESV:
@@ -98,22 +178,29 @@ uint32_t eqv_pair(uint32_t arg1, uint32_t arg2) {
       if (INT32_VALUE(arg1) == INT32_VALUE(arg2)) return C_TRUE;
       else return C_FALSE;
       break;
-    case T_SYM:
-      len1 = STR_LEN(arg1); len2 = STR_LEN(arg2);
-      if (len1 != len2) return C_FALSE;
-      if (strncmp(STR_START(arg1), STR_START(arg2), len1) == 0) 
-        return C_TRUE;
-      return C_FALSE;
+    case T_BIG:
+      return bignum_eqv(arg1, arg2) ? C_TRUE : C_FALSE;
+    case T_FLO:
+      /* the same bits: 0.0 and -0.0 aren't eqv?, and a NaN is itself */
+      return cells[arg1+1] == cells[arg2+1] ? C_TRUE : C_FALSE;
     default:
       break;
   }
   return C_FALSE;
 }
 
-uint32_t eqv(uint32_t args) {
-  TWO_ARGS(arg1, arg2);
+uint32_t eqv(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
   return eqv_pair(arg1, arg2);
 }
+
+/* identity; small integers and chars are immediate, so equal ones are
+   eq?, but integers outside the fixnum range are boxed */
+uint32_t eq(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
+  if (arg1 == arg2) return C_TRUE;
+  else return C_FALSE;
+}
      
 /* a helper function to make recursive calls easier */
 uint32_t equal_pair(uint32_t arg1, uint32_t arg2) {
@@ -123,7 +210,7 @@ uint32_t equal_pair(uint32_t arg1, uint32_t arg2) {
   switch(TYPE(arg1)) {
     case T_STR:
       if (STR_LEN(arg1) != STR_LEN(arg2)) return C_FALSE;
-      if (strncmp(STR_START(arg1), STR_START(arg2), STR_LEN(arg1)) == 0)
+      if (memcmp(STR_START(arg1), STR_START(arg2), STR_LEN(arg1)) == 0)
         return C_TRUE;
       else return C_FALSE;
       break;
@@ -141,6 +228,8 @@ uint32_t equal_pair(uint32_t arg1, uint32_t arg2) {
       }
       return C_TRUE;
       break;
+    case T_NVEC:
+      return nvector_equal(arg1, arg2) ? C_TRUE : C_FALSE;
     default:
       return eqv_pair(arg1, arg2);
       break;
@@ -148,43 +237,45 @@ uint32_t equal_pair(uint32_t arg1, uint32_t arg2) {
   return C_FALSE;
 }
 
-uint32_t equal(uint32_t args) {
-  TWO_ARGS(arg1, arg2);
+uint32_t equal(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
   return equal_pair(arg1, arg2);
 }
 
 /* Pairs and lists. */
 
-uint32_t car(uint32_t args) {
-  ONE_ARG(arg);
+uint32_t car(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg = args[0];
+  if (TYPE(arg) != T_PAIR) return 0;
   return CAR(arg);
 }
-uint32_t cdr(uint32_t args) {
-  ONE_ARG(arg);
+uint32_t cdr(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg = args[0];
+  if (TYPE(arg) != T_PAIR) return 0;
   return CDR(arg);
 }
-uint32_t list(uint32_t args) {
-  /* easiest builtin ever. */
-  return args;
+uint32_t list(const uint32_t *args, uint32_t nargs) {
+  /* the one builtin that still conses its arguments */
+  return nargs ? make_list((uint32_t *)args, nargs) : C_EMPTY;
 }
-uint32_t cons(uint32_t args) {
-  TWO_ARGS(arg1, arg2);
+uint32_t cons(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
   return store_pair(arg1, arg2);
 }
-uint32_t set_car(uint32_t args) {
-  TWO_ARGS(arg1, arg2);
+uint32_t set_car(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
   if (TYPE(arg1) != T_PAIR) return 0;
   SET_CAR(arg1, arg2);
   return C_UNSPEC;
 }
-uint32_t set_cdr(uint32_t args) {
-  TWO_ARGS(arg1, arg2);
+uint32_t set_cdr(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg1 = args[0], arg2 = args[1];
   if (TYPE(arg1) != T_PAIR) return 0;
   SET_CDR(arg1, arg2);
   return C_UNSPEC;
 }
-uint32_t length(uint32_t args) {
-  ONE_ARG(list);
+uint32_t length(const uint32_t *args, uint32_t nargs) {
+  uint32_t list = args[0];
   int len = length_list(list);
   if (len == -1) return 0;
   else return store_int32(len);
@@ -193,67 +284,172 @@ uint32_t length(uint32_t args) {
 
 /* Booleans. */
 
-uint32_t not(uint32_t args) {
-  ONE_ARG(arg);
+uint32_t not(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg = args[0];
   if (arg == C_FALSE) return C_TRUE;
   else return C_FALSE;
 }
 
 /* Numbers. */
 
-/* does either + or *, since the code's so similar */
-uint32_t plus_times(uint32_t args, int is_plus) {
-  int32_t accum = is_plus ? 0 : 1;
+/* 0 if val isn't a number */
+static int number_value(uint32_t val, double *num) {
+  if (TYPE(val) == T_FLO) *num = FLO_VALUE(val);
+  else if (TYPE(val) == T_INT32) *num = INT32_VALUE(val);
+  else if (TYPE(val) == T_BIG) *num = bignum_to_double(val);
+  else return 0;
+  return 1;
+}
+
+/* The rest of a sum, difference or product from argument i on, once
+   there's a flonum in it: start is the total so far. */
+uint32_t flonum_arith(double start, const uint32_t *args, uint32_t nargs,
+                      uint32_t i, int op) {
+  double accum = start, num;
+  for (; i < nargs; i++) {
+    if (!number_value(args[i], &num)) return 0;
+    /* taking the first argument as it is, rather than adding it to 0,
+       keeps the sign of (- 0.0) and (+ -0.0) */
+    if (i == 0) accum = SUBTRACTS(op, i, nargs) ? -num : num;
+    else if (op == '*') accum *= num;
+    else if (SUBTRACTS(op, i, nargs)) accum -= num;
+    else accum += num;
+  }
+  return store_flonum(accum);
+}
+
+/* Does +, - or *, since the code's so similar. Goes over to flonums at
+   the first flonum, and to bignums once the total doesn't fit in 32
+   bits, or an argument doesn't. */
+uint32_t arith(const uint32_t *args, uint32_t nargs, int op) {
+  int32_t accum = op == '*' ? 1 : 0, res;
   uint32_t val;
-  while(args != C_EMPTY) {
-    val = CAR(args);
-    if (TYPE(val) != T_INT32) return 0;
-    int32_t signed_val = (int32_t)(cells[val] >> 32);
-    if (is_plus) accum += signed_val;
-    else accum *= signed_val;
-    args = CDR(args);
+  for (uint32_t i = 0; i < nargs; i++) {
+    val = args[i];
+    if (TYPE(val) == T_FLO)
+      return flonum_arith(accum, args, nargs, i, op);
+    if (TYPE(val) != T_INT32)
+      return bignum_arith(accum, args, nargs, i, op);
+    int32_t signed_val = INT32_VALUE(val);
+    int overflow;
+    if (op == '*')
+      overflow = __builtin_mul_overflow(accum, signed_val, &res);
+    else if (SUBTRACTS(op, i, nargs))
+      overflow = __builtin_sub_overflow(accum, signed_val, &res);
+    else
+      overflow = __builtin_add_overflow(accum, signed_val, &res);
+    if (overflow) return bignum_arith(accum, args, nargs, i, op);
+    accum = res;
+  }
+  return store_int32(accum);
+}
+
+uint32_t plus(const uint32_t *args, uint32_t nargs) {
+  return arith(args, nargs, '+');
+}
+
+uint32_t minus(const uint32_t *args, uint32_t nargs) {
+  return arith(args, nargs, '-');
+}
+
+uint32_t times(const uint32_t *args, uint32_t nargs) {
+  return arith(args, nargs, '*');
+}
+
+/* -1, 0 or 1 as a is less than, equal to or greater than b; 2 if they
+   can't be ordered, as a NaN can't, and -2 if one isn't a number */
+static int compare_numbers(uint32_t a, uint32_t b) {
+  uint32_t ta = TYPE(a), tb = TYPE(b);
+  double x, y;
+  if (ta == T_INT32 && tb == T_INT32) {
+    int32_t i = INT32_VALUE(a), j = INT32_VALUE(b);
+    return (i > j) - (i < j);
+  }
+  if (!number_value(a, &x) || !number_value(b, &y)) return -2;
+  if (ta == T_FLO || tb == T_FLO) {
+    if (x != x || y != y) return 2;
+    return (x > y) - (x < y);
+  }
+  return bignum_compare(a, b);
+}
+
+/* each argument against the next */
+static uint32_t compare_all(const uint32_t *args, uint32_t nargs, int want) {
+  uint32_t res = C_TRUE;
+  double num;
+  if (nargs == 1 && !number_value(args[0], &num)) return 0;
+  for (uint32_t i = 0; i+1 < nargs; i++) {
+    int cmp = compare_numbers(args[i], args[i+1]);
+    if (cmp == -2) return 0;
+    if (cmp != want) res = C_FALSE;
   }
-  CHECK_CELLS(1);
-  uint32_t unsigned_val = (uint32_t)accum;
-  uint32_t res = next_cell;
-  cells[next_cell++] = T_INT32 | (uint64_t)unsigned_val << 32;
   return res;
 }
 
-uint32_t plus(uint32_t args) {
-  return plus_times(args, 1);
+uint32_t less(const uint32_t *args, uint32_t nargs) {
+  return compare_all(args, nargs, -1);
 }
 
-uint32_t times(uint32_t args) {
-  return plus_times(args, 0);
+uint32_t num_equal(const uint32_t *args, uint32_t nargs) {
+  return compare_all(args, nargs, 0);
+}
+
+/* Integer division, truncating; by zero is an error. */
+static uint32_t divide(const uint32_t *args, int remainder) {
+  uint32_t a = args[0], b = args[1];
+  if ((TYPE(a) != T_INT32 && TYPE(a) != T_BIG) ||
+      (TYPE(b) != T_INT32 && TYPE(b) != T_BIG))
+    return 0;
+  if (TYPE(b) == T_INT32 && INT32_VALUE(b) == 0) return 0;
+  if (TYPE(a) == T_INT32 && TYPE(b) == T_INT32) {
+    int32_t x = INT32_VALUE(a), y = INT32_VALUE(b);
+    if (!(x == INT32_MIN && y == -1))
+      return store_int32(remainder ? x % y : x / y);
+  }
+  return bignum_divide(a, b, remainder);
+}
+
+uint32_t integer_quotient(const uint32_t *args, uint32_t nargs) {
+  return divide(args, 0);
+}
+
+uint32_t integer_remainder(const uint32_t *args, uint32_t nargs) {
+  return divide(args, 1);
 }
 
 /* Vectors. */
 
-uint32_t vector_length(uint32_t args) {
-  ONE_ARG(arg);
+uint32_t vector_length(const uint32_t *args, uint32_t nargs) {
+  uint32_t arg = args[0];
   if (TYPE(arg) != T_VECT) return 0;
   return store_int32(VECTOR_LEN(arg));
 }  
 
-uint32_t vector_ref(uint32_t args) {
-  TWO_ARGS(vect, index_k);
+uint32_t vector_ref(const uint32_t *args, uint32_t nargs) {
+  uint32_t vect = args[0], index_k = args[1];
   if (TYPE(vect) != T_VECT || TYPE(index_k) != T_INT32) return 0;
   int32_t k = INT32_VALUE(index_k);
   if (k < 0 || k >= VECTOR_LEN(vect)) return 0;
   return (VECTOR_START(vect))[k];
 }  
 
-uint32_t vector_list(uint32_t args) {
-  ONE_ARG(vect);
+uint32_t vector_list(const uint32_t *args, uint32_t nargs) {
+  uint32_t vect = args[0];
   if (TYPE(vect) != T_VECT) return 0;
+  if (VECTOR_LEN(vect) == 0) return C_EMPTY;
+  /* make room first: make_list() reads from inside the vector */
+  GC_ROOT(vect);
+  CHECK_CELLS(2*VECTOR_LEN(vect));
+  GC_UNROOT(1);
   return make_list(VECTOR_START(vect), VECTOR_LEN(vect));
 }
 
-uint32_t list_vector(uint32_t args) {
-  ONE_ARG(list);
+uint32_t list_vector(const uint32_t *args, uint32_t nargs) {
+  uint32_t list = args[0];
   int len = length_list(list); if (len == -1) return 0;
+  GC_ROOT(list);
   uint32_t index = make_vector(len, 0);
+  GC_UNROOT(1);
   uint32_t *elements = VECTOR_START(index);
   for (int i = 0; i < len; i++) {
     *elements++ = CAR(list);
@@ -262,48 +458,146 @@ uint32_t list_vector(uint32_t args) {
   return index;
 }
 
+/* Files. */
+
+/* loading evaluates and saving collects, which move things; they get
+   a copy of the name */
+static char *copy_path(uint32_t name) {
+  char *path = malloc(STR_LEN(name)+1);
+  if (path == 0) die("couldn't alloc memory for a file name");
+  memcpy(path, STR_START(name), STR_LEN(name));
+  path[STR_LEN(name)] = '\0';
+  return path;
+}
+
+uint32_t load(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_STR) return 0;
+  char *path = copy_path(args[0]);
+  int ok = load_file(path, use_fasl);
+  free(path);
+  return ok ? C_UNSPEC : 0;
+}
+
+uint32_t save_image(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_STR) return 0;
+  char *path = copy_path(args[0]);
+  int ok = write_image(path);
+  free(path);
+  return ok ? C_UNSPEC : 0;
+}
+
+/* Statistics. */
+
+/* (name . count) consed onto list; counts past int32 are clamped */
+static uint32_t add_count(uint32_t list, const char *name, uint64_t count) {
+  GC_ROOT(list);
+  uint32_t sym = intern_symbol(name, strlen(name));
+  GC_ROOT(sym);
+  uint32_t num = store_int32(count > INT32_MAX ? INT32_MAX : count);
+  uint32_t entry = store_pair(sym, num);
+  GC_UNROOT(2);
+  return store_pair(entry, list);
+}
+
+#if STATS
+/* (name . sublist) consed onto list */
+static uint32_t add_list(uint32_t list, const char *name, uint32_t sublist) {
+  GC_ROOT(list); GC_ROOT(sublist);
+  uint32_t sym = intern_symbol(name, strlen(name));
+  uint32_t entry = store_pair(sym, sublist);
+  GC_UNROOT(2);
+  return store_pair(entry, list);
+}
+#endif
+
+/* An association list of the statistics print_stats() shows; the
+   counters are only there if they were compiled in. */
+uint32_t runtime_stats(const uint32_t *args, uint32_t nargs) {
+  uint32_t list = C_EMPTY;
+  GC_ROOT(list);
+#if STATS
+  uint32_t sublist = C_EMPTY;
+  GC_ROOT(sublist);
+  for (uint32_t i = builtin_count(); i > 0; i--) {
+    if (stats.builtin_calls[i-1])
+      sublist = add_count(sublist, builtin_name(i-1), stats.builtin_calls[i-1]);
+  }
+  list = add_list(list, "builtin-calls", sublist);
+  list = add_count(list, "max-vm-frames", stats.max_vm_frames);
+  list = add_count(list, "max-eval-depth", stats.max_eval_depth);
+  list = add_count(list, "frame-hops", stats.frame_hops);
+  list = add_count(list, "lambda-calls", stats.lambda_calls);
+  sublist = C_EMPTY;
+  for (uint32_t i = TYPE_MASK+1; i > 0; i--) {
+    if (stats.cells[i-1])
+      sublist = add_count(sublist, type_name(i-1), stats.cells[i-1]);
+  }
+  list = add_list(list, "cells", sublist);
+  GC_UNROOT(1);
+#endif
+  list = add_count(list, "peak-heap", heap_size*sizeof(uint64_t));
+  list = add_count(list, "collections", gc_count);
+  list = add_count(list, "cells-allocated", gc_cells_allocated());
+  GC_UNROOT(1);
+  return list;
+}
+
 void register_builtins(void) {
+  gc_add_visitor(visit_builtins);
+
   /* types */
-  register_builtin("procedure?", procedure_p);
-  register_builtin("vector?", vector_p);
-  register_builtin("string?", string_p);
-  register_builtin("symbol?", symbol_p);
-  register_builtin("char?", char_p);
-  register_builtin("pair?", pair_p);
-  register_builtin("number?", number_p);
-  register_builtin("boolean?", boolean_p);
-  register_builtin("null?", null_p);
-  register_builtin("list?", list_p);
+  register_builtin("procedure?", procedure_p, 1, 1);
+  register_builtin("vector?", vector_p, 1, 1);
+  register_builtin("string?", string_p, 1, 1);
+  register_builtin("symbol?", symbol_p, 1, 1);
+  register_builtin("char?", char_p, 1, 1);
+  register_builtin("pair?", pair_p, 1, 1);
+  register_builtin("number?", number_p, 1, 1);
+  register_builtin("boolean?", boolean_p, 1, 1);
+  register_builtin("null?", null_p, 1, 1);
+  register_builtin("list?", list_p, 1, 1);
 
   /* equality */
-  register_builtin("eqv?", eqv);
+  register_builtin("eqv?", eqv, 2, 2);
+  register_builtin("eq?", eq, 2, 2);
 
-  /* TODO: when symbols have unique identity per name ("interned"), it may
-     make sense to have a separate faster eq? */
-  register_builtin("eq?", eqv);
-
-  register_builtin("equal?", equal);
+  register_builtin("equal?", equal, 2, 2);
 
   /* booleans */
-  register_builtin("not", list_p);
+  register_builtin("not", not, 1, 1);
 
   /* pairs and lists */
-  register_builtin("list", list);
-  register_builtin("cons", cons);
-  register_builtin("car", car);
-  register_builtin("cdr", cdr);
-  register_builtin("set-car!", set_car);
-  register_builtin("set-cdr!", set_cdr);
-  register_builtin("length", length);
+  register_builtin("list", list, 0, ANY_ARGS);
+  register_builtin("cons", cons, 2, 2);
+  register_builtin("car", car, 1, 1);
+  register_builtin("cdr", cdr, 1, 1);
+  register_builtin("set-car!", set_car, 2, 2);
+  register_builtin("set-cdr!", set_cdr, 2, 2);
+  register_builtin("length", length, 1, 1);
 
   /* numbers */
-  register_builtin("+", plus);
-  register_builtin("*", times);
+  register_primitive(F_ADD, "+", plus, 0, ANY_ARGS);
+  register_primitive(F_SUB, "-", minus, 1, ANY_ARGS);
+  register_primitive(F_MUL, "*", times, 0, ANY_ARGS);
+  register_primitive(F_LT, "<", less, 1, ANY_ARGS);
+  register_primitive(F_NUMEQ, "=", num_equal, 1, ANY_ARGS);
+  register_primitive(F_QUOTIENT, "quotient", integer_quotient, 2, 2);
+  register_primitive(F_REMAINDER, "remainder", integer_remainder, 2, 2);
 
   /* vectors */
-  register_builtin("vector-length", vector_length);
-  register_builtin("vector-ref", vector_ref);
-  register_builtin("vector->list", vector_list);
-  register_builtin("list->vector", list_vector);
+  register_builtin("vector-length", vector_length, 1, 1);
+  register_builtin("vector-ref", vector_ref, 2, 2);
+  register_builtin("vector->list", vector_list, 1, 1);
+  register_builtin("list->vector", list_vector, 1, 1);
+
+  /* files */
+  register_builtin("load", load, 1, 1);
+  register_builtin("save-image", save_image, 1, 1);
+
+  /* statistics */
+  register_builtin("runtime-stats", runtime_stats, 0, 0);
+
+  register_nvector_builtins();
+  register_string_builtins();
 }
 
@@ -1,44 +1,115 @@
 /* max arguments in a function call */
 #define MAX_ARGS 256
 
+/* max nesting of the tree walker's eval(), which recurses in C for
+   calls not in tail position */
+#define MAX_EVAL_DEPTH 20000
+
 /* Working memory in sketch is an array of 64-bit cells. Each value
    spans 1 or more cells, and the first cell for the value devotes
    some bits to its type and other important information. */
 
-#define MAX_CELLS 1000000
-extern uint64_t cells[];
+/* The heap is reserved up front and committed in chunks as it fills
+   (see gc.c), so cells never moves; heap_size is the committed part. */
+extern uint64_t *cells;
+extern uint64_t heap_size;
 extern uint32_t next_cell;
-extern uint32_t toplevel_env;
+extern uint32_t frame_base, frame_top, frame_limit;
+extern uint32_t *globals;
+
+/* Every value on the heap starts at an even index and takes an even
+   number of cells. Odd values are never indices: they're immediates
+   carrying a small integer or a character in the upper bits, with the
+   kind in the two low bits. Those take no cells at all. */
+#define CELLS_EVEN(n) (((n) + 1) & ~1u)
+#define IMMEDIATE(i) ((i) & 1)
+#define FIXNUM_TAG 1
+#define CHAR_TAG 3
+#define FIXNUM_MIN (-(1 << 29))
+#define FIXNUM_MAX ((1 << 29) - 1)
+#define MAKE_FIXNUM(n) ((uint32_t)(n) << 2 | FIXNUM_TAG)
+#define MAKE_CHAR(c) ((uint32_t)(c) << 2 | CHAR_TAG)
 
 /* special index values, pre-filled and always occupied */
 #define C_ERROR 0 
-#define C_UNSPEC 1
-#define C_EMPTY 2
-#define C_FALSE 3
-#define C_TRUE 4
+#define C_UNSPEC 2
+#define C_EMPTY 4
+#define C_FALSE 6
+#define C_TRUE 8
+
+/* special forms; prepare() puts these in place of the keyword symbols */
+#define C_DEFINE 10
+#define C_SET 12
+#define C_QUOTE 14
+#define C_IF 16
+
+/* primitives: prepare() puts these in place of +, -, *, <, =, quotient
+   and remainder in calls on two arguments, e.g. (- n 1), for eval() to
+   do inline; see fixnum_primitive() */
+#define C_ADD 18
+#define C_SUB 20
+#define C_MUL 22
+#define C_LT 24
+#define C_NUMEQ 26
+#define C_QUOTIENT 28
+#define C_REMAINDER 30
 
 /* regular values created during normal work start from here */
-#define C_STARTFROM 5
+#define C_STARTFROM 32
 
-#define CHECK_CELLS(i) do { if (next_cell + i >= MAX_CELLS) \
-  die("out of cells"); } while(0)
+/* Makes sure i more cells can be allocated, collecting garbage or
+   growing the heap if necessary. Once it succeeds, no collection happens
+   until those i cells are used up, so a function can reserve up front
+   for several allocations and not worry about rooting in between. */
+#define HEAP_FULL(i) ((uint64_t)next_cell + (i) >= heap_size)
+#define CHECK_CELLS(i) do { if (HEAP_FULL(i)) gc_collect(i); } while(0)
+
+/* The garbage collector (gc.c) compacts the heap, moving values around.
+   Any C variable that holds a cell index across a call that may allocate
+   must be registered as a root first, so that the collector can find
+   the value and update the variable. Roots form a stack: a function
+   remembers gc_num_roots on entry and restores it before returning. */
+struct gc_root {
+  uint32_t *ptr;     /* the variable, or the start of an array */
+  uint32_t count;    /* how many indices live there */
+};
+extern struct gc_root *gc_roots;
+extern uint32_t gc_num_roots, gc_max_roots;
+
+#define GC_ROOTS(p, n) do { if (gc_num_roots == gc_max_roots) gc_grow_roots(); \
+  gc_roots[gc_num_roots].ptr = (p); gc_roots[gc_num_roots++].count = (n); \
+  } while(0)
+#define GC_ROOT(var) GC_ROOTS(&(var), 1)
+#define GC_UNROOT(n) do { gc_num_roots -= (n); } while(0)
 
 // 4 lowest-order bits for the type
 #define TYPE_MASK 15
-#define TYPE(i) (cells[i] & TYPE_MASK)
+#define TYPE(i) (IMMEDIATE(i) ? ((i) & 2 ? T_CHAR : T_INT32) \
+                              : cells[i] & TYPE_MASK)
 #define T_NONE   0  /* this cell is unused */
-#define T_INT32  1  /* immediate 32-bit value */
+#define T_INT32  1  /* integer: a fixnum, or boxed if out of fixnum range */
 #define T_PAIR   2  /* pair, uses next cell */
 #define T_STR    3  /* string */
 #define T_SYM    4  /* symbol */
 #define T_RESV   5  /* special value: bool or () */
 #define T_FUNC   6  /* function, a.k.a. closure */
 #define T_VECT   7  /* vector */
-#define T_CHAR   8  /* character */
-#define T_VAR    9  /* reference to a lexical variable */
+#define T_CHAR   8  /* character, always immediate */
+#define T_VAR    9  /* reference to a lexical or global variable */
+#define T_SPECIAL 10 /* special form keyword, resolved by prepare() */
+#define T_CODE   11 /* compiled bytecode, see vm.c */
+#define T_BIG    12 /* integer that doesn't fit in 32 bits, see bignum.c */
+#define T_FLO    13 /* flonum: an IEEE double, in the next cell */
+#define T_NVEC   14 /* numeric vector: raw elements, see nvector.c */
+#define T_BUILDER 15 /* string builder, see strings.c */
 
 /* true for builtin, as opposed to lambda-defined, functions */
 #define BLTIN_MASK 16
+/* true for lambdas that create no closures, so that nothing can capture
+   their environment; calls to them get it from the frame stack */
+#define LEAF_MASK 32
+/* true for negative bignums */
+#define BIG_NEGATIVE 64
 
 /* the next few defines depend on how the specific types are laid out */
 #define CAR(i) (cells[i+1] >> 32)
@@ -51,24 +122,90 @@ extern uint32_t toplevel_env;
 
 #define STR_START(i) ((char *)(cells+i+1))
 #define STR_LEN(i) (cells[i] >> 32)
+/* the length is the top half of the header */
+#define MAX_STRING 0xFFFFFFFFu
+
+/* a string builder: the bytes in it so far, and its buffer, a T_STR as
+   long as the room there is; laid out like a pair for the collector */
+#define BUILDER_USED(i) (uint32_t)(cells[i] >> 32)
+#define BUILDER_BUFFER(i) CDR(i)
 
 #define VECTOR_START(i) ((uint32_t *)(cells+i+1))
 #define VECTOR_LEN(i) (cells[i] >> 32)
 
-#define CHAR_VALUE(i) (unsigned char)(cells[i] >> 32)
-#define INT32_VALUE(i) (int32_t)(cells[i] >> 32)
+/* a bignum's magnitude, in 32-bit digits, least significant first */
+#define BIG_LEN(i) (uint32_t)(cells[i] >> 32)
+#define BIG_DIGITS(i) ((uint32_t *)(cells+i+1))
 
-#define VAR_FRAME(i) (uint32_t)((cells[i] >> 32) & 0xFFFF)
-#define VAR_SLOT(i) (uint32_t)((cells[i] >> 32) >> 16)
+union flo_bits {
+  uint64_t bits;
+  double value;
+};
+#define FLO_VALUE(i) (((union flo_bits){.bits = cells[(i)+1]}).value)
 
+/* a numeric vector's kind, its length in elements, and the elements */
+#define NVEC_KIND(i) (uint32_t)((cells[i] >> 8) & 0xFF)
+#define NVEC_LEN(i) (uint32_t)(cells[i] >> 32)
+#define NVEC_START(i) ((void *)(cells+i+1))
+#define NVEC_S32 0
+#define NVEC_F64 1
+#define NVEC_U8  2
+
+#define CHAR_VALUE(i) (unsigned char)((i) >> 2)
+#define INT32_VALUE(i) (IMMEDIATE(i) ? (int32_t)(i) >> 2 \
+                                     : (int32_t)(cells[i] >> 32))
+
+#define VAR_FRAME(i) (uint32_t)((cells[i] >> 16) & 0xFFFF)
+#define VAR_SLOT(i) (uint32_t)(cells[i] >> 32)
+/* the frame of a global variable, whose slot is an index in globals[] */
+#define GLOBAL_FRAME 0xFFFF
+
+#define SPECIAL_FORM(i) (uint32_t)(cells[i] >> 32)
+#define F_DEFINE 0
+#define F_SET    1
+#define F_QUOTE  2
+#define F_IF     3
+#define F_ADD    4
+#define F_SUB    5
+#define F_MUL    6
+#define F_LT     7
+#define F_NUMEQ  8
+#define F_QUOTIENT 9
+#define F_REMAINDER 10
+#define FIRST_PRIMITIVE F_ADD
+#define NUM_PRIMITIVES 7
+
+#define FUNC_DISPLAY(i) (uint32_t)((cells[i] >> 16) & 0xFFFF)
 #define FUNC_VARCOUNT(i) (uint32_t)((cells[i] >> 32) & 0xFFFF)
 #define FUNC_ARGCOUNT(i) (uint32_t)((cells[i] >> 32) >> 16)
 #define FUNC_BODY(i) CDR(i)
 #define FUNC_ENV(i) CAR(i)
 
+/* Builtins keep their arity where lambdas keep their counts: the fewest
+   and the most arguments they take. */
+#define BLTIN_MIN_ARGS(i) FUNC_ARGCOUNT(i)
+#define BLTIN_MAX_ARGS(i) FUNC_VARCOUNT(i)
+#define ANY_ARGS 0xFFFF
+/* and where the display would be, their number in register order */
+#define BLTIN_ID(i) FUNC_DISPLAY(i)
+#define MAX_BUILTINS 256
+#define BLTIN_ARGS_OK(i, n) ((n) >= BLTIN_MIN_ARGS(i) && (n) <= BLTIN_MAX_ARGS(i))
+
+/* Bytecode: the header has the number of 32-bit instruction words and
+   the maximum stack depth they need. The next cell links to the vector
+   of constants and to the source the code was compiled from; the words
+   themselves follow. */
+#define CODE_LEN(i) (uint32_t)(cells[i] >> 32)
+#define CODE_MAXSTACK(i) (uint32_t)((cells[i] >> 16) & 0xFFFF)
+#define CODE_CONSTS(i) CAR(i)
+#define CODE_SOURCE(i) CDR(i)
+#define CODE_START(i) ((uint32_t *)(cells+i+2))
+
 #define LIST_LIKE(i) (TYPE(i) == T_PAIR || i == C_EMPTY)
 
-typedef uint32_t (*builtin_t)(uint32_t);
+/* A builtin gets its evaluated arguments in an array, whose length has
+   already been checked against the arity it was registered with. */
+typedef uint32_t (*builtin_t)(const uint32_t *args, uint32_t nargs);
 
 /* functions in symbols.cc */
 int find_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame);
@@ -76,18 +213,181 @@ void add_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame);
 void add_symbol_table();
 void delete_symbol_table();
 uint32_t latest_table_size();
+uint32_t intern_symbol(const char *name, int len);
+uint32_t *interned_symbols(uint32_t *count);
+void *save_symbols(size_t *size);
+int load_symbols(const void *data, size_t size);
+uint32_t global_slots();
+int global_name(uint32_t slot, const char **name, int *len);
+
+/* functions in gc.c */
+void heap_init(uint64_t initial, uint64_t max, int hugepages);
+void gc_collect(uint32_t needed);
+void gc_grow_roots(void);
+void gc_add_global(uint32_t *ptr);
+int heap_load(int fd, uint64_t offset, uint32_t count);
+
+/* Roots that don't fit the stack above, like the VM's own stacks, are
+   reported by a visitor function that calls visit() on each of them. */
+typedef void (*gc_visitor_t)(void (*visit)(uint32_t *));
+void gc_add_visitor(gc_visitor_t visitor);
+extern uint64_t gc_count;
+uint64_t gc_cells_allocated(void);
+
+/* functions in vm.c */
+extern int use_vm;
+uint32_t compile_body(uint32_t body);
+uint32_t compile_toplevel(uint32_t form);
+uint32_t vm_run(uint32_t code, uint32_t env);
+
+/* functions in profile.c */
+extern int profiling, alloc_profiling;
+extern uint32_t profile_top, profile_builtin_id;
+void profile_start(const char *path);
+void alloc_profile_start(void);
+const char *profile_site_name(uint32_t sym, const char *outer);
+void profile_add_site(uint32_t body, const char *name);
+void profile_builtin(uint32_t id);
+void profile_call(uint32_t body);
+void profile_tail_call(uint32_t body);
+
+/* what the allocation profiler counts */
+#define ALLOC_PAIR    0
+#define ALLOC_VECTOR  1
+#define ALLOC_ENV     2
+#define ALLOC_INTEGER 3
+#define ALLOC_STRING  4
+#define ALLOC_SYMBOL  5
+#define ALLOC_CLOSURE 6
+#define ALLOC_CODE    7  /* prepared and compiled code */
+#define ALLOC_FLONUM  8
+void profile_alloc(int kind, uint32_t cells);
 
 /* functions in builtins.c */
 void register_builtins(void);
+uint32_t register_builtin(char *name, builtin_t func, uint32_t min_args,
+                          uint32_t max_args);
+uint32_t builtin_count(void);
+const char *builtin_name(uint32_t id);
+uint32_t flonum_arith(double start, const uint32_t *args, uint32_t nargs,
+                      uint32_t i, int op);
+uint32_t *builtin_locations(void);
+int relocate_builtins(const uint32_t *locations);
+int primitive_of(uint32_t slot);
+uint32_t primitive_slot(uint32_t form);
+int primitive_intact(uint32_t form);
+
+/* Sums, differences and products: op is '+', '-' or '*'. (- x) is
+   0 - x; otherwise only the arguments after the first are subtracted. */
+#define SUBTRACTS(op, i, nargs) ((op) == '-' && ((i) > 0 || (nargs) == 1))
+
+/* A primitive's work when both arguments are fixnums and the result is
+   one too; 0 if it isn't that simple, and the builtin has to do it. */
+static inline int fixnum_primitive(uint32_t form, uint32_t a, uint32_t b,
+                                   uint32_t *res) {
+  if ((a & 3) != FIXNUM_TAG || (b & 3) != FIXNUM_TAG) return 0;
+  int32_t x = (int32_t)a >> 2, y = (int32_t)b >> 2;
+  int64_t r;
+  switch (form) {
+    case F_ADD: r = x + y; break;
+    case F_SUB: r = x - y; break;
+    case F_MUL: r = (int64_t)x * y; break;
+    case F_LT: *res = x < y ? C_TRUE : C_FALSE; return 1;
+    case F_NUMEQ: *res = a == b ? C_TRUE : C_FALSE; return 1;
+    case F_QUOTIENT: if (y == 0) return 0; r = x / y; break;
+    case F_REMAINDER: if (y == 0) return 0; r = x % y; break;
+    default: return 0;
+  }
+  if (r < FIXNUM_MIN || r > FIXNUM_MAX) return 0;
+  *res = MAKE_FIXNUM(r);
+  return 1;
+}
+
+/* functions in bignum.c */
+uint32_t bignum_arith(int32_t start, const uint32_t *args, uint32_t nargs,
+                      uint32_t i, int op);
+int bignum_eqv(uint32_t a, uint32_t b);
+int bignum_compare(uint32_t a, uint32_t b);
+uint32_t bignum_divide(uint32_t a, uint32_t b, int remainder);
+uint32_t store_bignum(const uint32_t *digits, uint32_t len, int negative);
+uint32_t store_int64(int64_t num);
+uint32_t read_bignum(const char *digits, uint32_t len, int negative);
+void print_bignum(uint32_t index);
+double bignum_to_double(uint32_t index);
+
+/* functions in nvector.c */
+void register_nvector_builtins(void);
+uint32_t nvector_cells(uint32_t kind, uint32_t len);
+void print_nvector(uint32_t index);
+int nvector_equal(uint32_t a, uint32_t b);
+int set_simd(const char *name);
+const char *simd_name(void);
+
+/* functions in strings.c */
+void register_string_builtins(void);
+
+/* functions in fasl.c */
+extern int use_fasl;
+struct fasl;
+struct fasl *fasl_begin(const char *text, size_t size);
+void fasl_add(struct fasl *f, uint32_t form);
+void fasl_end(struct fasl *f, const char *path, int ok);
+int fasl_load(const char *path, const char *text, size_t size);
+
+/* functions in image.c */
+int write_image(const char *path);
+int read_image(const char *path);
+
+/* Runtime statistics (stats.c). The counters cost an increment here and
+   there; building with STATS=0 (see the Makefile) leaves them out. */
+#ifndef STATS
+#define STATS 1
+#endif
+#if STATS
+struct stats {
+  uint64_t cells[TYPE_MASK+1];         /* allocated on the heap, by type */
+  uint64_t builtin_calls[MAX_BUILTINS];  /* by BLTIN_ID() */
+  uint64_t lambda_calls;
+  uint64_t frame_hops;       /* reaching an outer lambda's environment */
+  uint32_t max_eval_depth;  /* of eval()'s recursion */
+  uint32_t max_vm_frames;
+};
+extern struct stats stats;
+#define STAT(x) do { x; } while(0)
+#else
+#define STAT(x) do { } while(0)
+#endif
+void print_stats(void);
+const char *type_name(uint32_t type);
 
-/* functions in check.c */
+/* functions in sketch.c */
+void init_sketch(uint64_t heap_initial, uint64_t heap_max, int hugepages);
+void intern_keywords(void);
+char *skip_space(char *str);
 int read_value(char **pstr, uint32_t *pindex, int implicit_paren);
+void dump_value(uint32_t index, int implicit_paren);
+uint32_t prepare(uint32_t index, uint32_t *deferred_define);
 void die(char *msg);
 int check_list(uint32_t index, int count, int strict);
 uint32_t store_pair(uint32_t first, uint32_t second);
+uint32_t make_string(uint32_t size, int type);
+uint32_t store_string(char *str, char *end, int type);
 uint32_t store_int32(int32_t num);
+uint32_t store_flonum(double num);
+void print_flonum(double num);
+uint32_t store_var(uint32_t slot, uint32_t frame);
 int length_list(uint32_t index);
 uint32_t make_list(uint32_t *values, uint32_t count);
 uint32_t make_vector(uint32_t size, int zero_it);
+uint32_t make_env(uint32_t size);
+uint32_t make_frame_env(uint32_t size);
+void init_display(uint32_t env, uint32_t func);
+void reserve_globals(uint32_t count);
 void store_env(uint32_t env, uint32_t slot, uint32_t value);
+uint32_t follow_frame(uint32_t env, uint32_t frame);
+void undefined_global(uint32_t slot);
+uint32_t eval(uint32_t index, uint32_t env);
+uint32_t eval_prepared(uint32_t prepared);
+uint32_t eval_toplevel(uint32_t index);
+int load_file(const char *path, int cache);
 
@@ -0,0 +1,433 @@
+#define _POSIX_C_SOURCE 200809L  /* for rename() over an existing file */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Fasl caches. (load "lib.scm") keeps the forms it has read and
+   prepared in lib.scm.fasl, in a compact binary form, and the next load
+   of an unchanged lib.scm builds them straight from there, with no
+   reading or preparing. Each form still runs in order, as it would
+   have.
+
+   The cache is keyed by a hash of the source and FASL_VERSION, which
+   goes up whenever prepared forms change shape. Global variables are
+   kept by name, since their slots in globals[] depend on what was
+   defined before, and looked up again as prepare() would: only a
+   toplevel define makes a new one. Everything else is as prepare() left
+   it. Compiled
+   bodies aren't kept either, as they refer to global slots too: they
+   go in as their source, and get compiled again on the way back.
+
+   The profilers name lambdas as they're prepared, so they need the
+   real thing, and the cache is left alone while they run. */
+
+/* turned off by --no-fasl, see main() */
+int use_fasl = 1;
+
+#define FASL_MAGIC "sketchfl"
+/* 1: the first; 2: bignums, flonums, and the specials C_ADD to
+   C_REMAINDER for inline primitives; 3: FASL_DEFINE */
+#define FASL_VERSION 3
+
+struct fasl_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t forms;
+  uint64_t source_hash;
+  uint64_t source_size;
+};
+
+/* Items. Each starts with one of these, and numbers are unsigned
+   LEB128. */
+enum {
+  FASL_FIXED,   /* index: an immediate or a fixed cell, e.g. () */
+  FASL_INT,     /* zigzag number: a boxed integer */
+  FASL_STR,     /* length, bytes */
+  FASL_SYM,     /* length, bytes: interned when read */
+  FASL_LIST,    /* n, n items, then the item in the last cdr */
+  FASL_VECT,    /* n, n items */
+  FASL_GLOBAL,  /* length, bytes: a global variable by name */
+  FASL_GLOBALREF, /* k: the same global as the k-th FASL_GLOBAL */
+  FASL_VAR,     /* frame, slot: a lexical variable */
+  FASL_FUNC,    /* 8-byte header, then the body: a lambda */
+  FASL_BIG,     /* sign, n, n digits: a bignum */
+  FASL_FLO,     /* 8 bytes: a flonum */
+  FASL_DEFINE,  /* length, bytes: a global a toplevel define binds */
+};
+
+/* FNV-1a, 64 bits */
+static uint64_t hash_source(const char *text, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static char *cache_path(const char *path) {
+  char *res = malloc(strlen(path) + sizeof(".fasl.tmp"));
+  if (res == 0) die("couldn't alloc memory for a file name");
+  strcpy(res, path);
+  strcat(res, ".fasl");
+  return res;
+}
+
+/* Writing. Forms go into a buffer as they're prepared, and to the
+   cache only if the whole file loads. Nothing here allocates cells. */
+
+struct fasl {
+  struct fasl_header header;
+  unsigned char *data;
+  size_t size, max_size;
+  int broken;  /* a form had something we can't write */
+  /* for each slot in globals[], 1 + its k for FASL_GLOBALREF, or 0 if
+     it hasn't been named yet */
+  uint32_t *global_refs;
+  uint32_t num_refs, max_slots;
+};
+
+static void put_bytes(struct fasl *f, const void *bytes, size_t count) {
+  if (f->size + count > f->max_size) {
+    f->max_size = (f->size + count) * 2;
+    f->data = realloc(f->data, f->max_size);
+    if (f->data == 0) die("couldn't alloc memory for a fasl cache");
+  }
+  memcpy(f->data + f->size, bytes, count);
+  f->size += count;
+}
+
+static void put_byte(struct fasl *f, unsigned char byte) {
+  put_bytes(f, &byte, 1);
+}
+
+static void put_number(struct fasl *f, uint64_t n) {
+  while (n >= 0x80) {
+    put_byte(f, (n & 0x7F) | 0x80);
+    n >>= 7;
+  }
+  put_byte(f, n);
+}
+
+static void put_name(struct fasl *f, int tag, const char *name, size_t len) {
+  put_byte(f, tag);
+  put_number(f, len);
+  put_bytes(f, name, len);
+}
+
+/* a variable; defining says it's the one a define binds */
+static int put_var(struct fasl *f, uint32_t var, int defining) {
+  const char *name;
+  int len;
+  if (VAR_FRAME(var) != GLOBAL_FRAME) {
+    put_byte(f, FASL_VAR);
+    put_number(f, VAR_FRAME(var));
+    put_number(f, VAR_SLOT(var));
+    return 1;
+  }
+  uint32_t slot = VAR_SLOT(var);
+  if (slot >= f->max_slots) {
+    uint32_t size = slot+1 > f->max_slots*2 ? slot+1 : f->max_slots*2;
+    f->global_refs = realloc(f->global_refs, size*sizeof(uint32_t));
+    if (f->global_refs == 0) die("couldn't alloc memory for a fasl cache");
+    memset(f->global_refs + f->max_slots, 0,
+           (size - f->max_slots)*sizeof(uint32_t));
+    f->max_slots = size;
+  }
+  if (f->global_refs[slot]) {
+    put_byte(f, FASL_GLOBALREF);
+    put_number(f, f->global_refs[slot]-1);
+  } else {
+    if (!global_name(slot, &name, &len)) return 0;
+    put_name(f, defining ? FASL_DEFINE : FASL_GLOBAL, name, len);
+    f->global_refs[slot] = ++f->num_refs;
+  }
+  return 1;
+}
+
+static int put_item(struct fasl *f, uint32_t index) {
+  uint32_t count, list, body;
+  if (index < C_STARTFROM || IMMEDIATE(index)) {
+    if (index == C_ERROR) return 0;
+    put_byte(f, FASL_FIXED);
+    put_number(f, index);
+    return 1;
+  }
+  switch(TYPE(index)) {
+    case T_INT32:
+      put_byte(f, FASL_INT);
+      /* zigzag, so that small negative numbers stay short */
+      put_number(f, ((uint32_t)INT32_VALUE(index) << 1) ^
+                    (uint32_t)(INT32_VALUE(index) >> 31));
+      return 1;
+    case T_STR:
+    case T_SYM:
+      put_name(f, TYPE(index) == T_STR ? FASL_STR : FASL_SYM,
+               STR_START(index), STR_LEN(index));
+      return 1;
+    case T_PAIR:
+      count = 0;
+      for (list = index; TYPE(list) == T_PAIR; list = CDR(list)) count++;
+      put_byte(f, FASL_LIST);
+      put_number(f, count);
+      for (list = index; TYPE(list) == T_PAIR; list = CDR(list)) {
+        int ok = list == CDR(index) && CAR(index) == C_DEFINE ?
+                 put_var(f, CAR(list), 1) : put_item(f, CAR(list));
+        if (!ok) return 0;
+      }
+      return put_item(f, list);
+    case T_VECT:
+      put_byte(f, FASL_VECT);
+      put_number(f, VECTOR_LEN(index));
+      for (uint32_t i = 0; i < VECTOR_LEN(index); i++)
+        if (!put_item(f, VECTOR_START(index)[i])) return 0;
+      return 1;
+    case T_VAR:
+      return put_var(f, index, 0);
+    case T_BIG:
+      put_byte(f, FASL_BIG);
+      put_number(f, (cells[index] & BIG_NEGATIVE) != 0);
+      put_number(f, BIG_LEN(index));
+      for (uint32_t i = 0; i < BIG_LEN(index); i++)
+        put_number(f, BIG_DIGITS(index)[i]);
+      return 1;
+    case T_FLO:
+      put_byte(f, FASL_FLO);
+      put_bytes(f, &cells[index+1], sizeof(uint64_t));
+      return 1;
+    case T_FUNC:
+      if (cells[index] & BLTIN_MASK) return 0;
+      put_byte(f, FASL_FUNC);
+      put_bytes(f, &cells[index], sizeof(uint64_t));
+      body = FUNC_BODY(index);
+      if (TYPE(body) == T_CODE) body = CODE_SOURCE(body);
+      return put_item(f, body);
+    default:
+      return 0;
+  }
+}
+
+struct fasl *fasl_begin(const char *text, size_t size) {
+  struct fasl *f = calloc(1, sizeof(struct fasl));
+  if (f == 0) die("couldn't alloc memory for a fasl cache");
+  memcpy(f->header.magic, FASL_MAGIC, sizeof(f->header.magic));
+  f->header.version = FASL_VERSION;
+  f->header.source_hash = hash_source(text, size);
+  f->header.source_size = size;
+  return f;
+}
+
+void fasl_add(struct fasl *f, uint32_t form) {
+  if (f->broken) return;
+  if (put_item(f, form)) f->header.forms++;
+  else f->broken = 1;
+}
+
+/* writes the cache if ok, quietly giving up if it can't */
+void fasl_end(struct fasl *f, const char *path, int ok) {
+  if (ok && !f->broken) {
+    char *fasl_path = cache_path(path), *tmp_path = cache_path(path);
+    strcat(tmp_path, ".tmp");
+    FILE *file = fopen(tmp_path, "wb");
+    if (file) {
+      int written = fwrite(&f->header, sizeof(f->header), 1, file) == 1 &&
+                    fwrite(f->data, 1, f->size, file) == f->size;
+      if (fclose(file) == 0 && written) rename(tmp_path, fasl_path);
+      else remove(tmp_path);
+    }
+    free(fasl_path); free(tmp_path);
+  }
+  free(f->data);
+  free(f->global_refs);
+  free(f);
+}
+
+/* Reading. */
+
+struct fasl_in {
+  const unsigned char *p, *end;
+  uint32_t *global_slots;  /* of each FASL_GLOBAL so far */
+  uint32_t num_globals, max_globals;
+  int undefined;  /* a FASL_GLOBAL named nothing defined */
+};
+
+static int get_number(struct fasl_in *in, uint64_t *n) {
+  *n = 0;
+  for (int shift = 0; in->p < in->end && shift < 64; shift += 7) {
+    unsigned char byte = *in->p++;
+    *n |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return 1;
+  }
+  return 0;
+}
+
+/* a length, and that many bytes after it */
+static const char *get_name(struct fasl_in *in, uint64_t *len) {
+  if (!get_number(in, len) || *len > (uint64_t)(in->end - in->p)) return 0;
+  const char *name = (const char *)in->p;
+  in->p += *len;
+  return name;
+}
+
+/* the item's index, or 0 if the data is bad */
+static uint32_t get_item(struct fasl_in *in) {
+  uint64_t n, frame, negative;
+  uint32_t res = 0, item = 0, last = 0, slot, global_frame, *digits;
+  union flo_bits flo;
+  const char *name;
+  uint64_t header;
+  if (in->p == in->end) return 0;
+  unsigned char tag = *in->p++;
+  switch(tag) {
+    case FASL_FIXED:
+      if (!get_number(in, &n) || n == C_ERROR || n > UINT32_MAX ||
+          (!IMMEDIATE(n) && n >= C_STARTFROM))
+        return 0;
+      return n;
+    case FASL_INT:
+      if (!get_number(in, &n) || n > UINT32_MAX) return 0;
+      return store_int32((int32_t)((uint32_t)n >> 1 ^ -(uint32_t)(n & 1)));
+    case FASL_STR:
+      if ((name = get_name(in, &n)) == 0) return 0;
+      return store_string((char *)name, (char *)name + n, T_STR);
+    case FASL_SYM:
+      if ((name = get_name(in, &n)) == 0) return 0;
+      return intern_symbol(name, n);
+    case FASL_LIST:
+      if (!get_number(in, &n) || n == 0) return 0;
+      res = C_EMPTY;
+      GC_ROOT(res); GC_ROOT(last); GC_ROOT(item);
+      for (uint64_t i = 0; i < n; i++) {
+        if ((item = get_item(in)) == 0) break;
+        uint32_t pair = store_pair(item, C_EMPTY);
+        if (last) SET_CDR(last, pair);
+        else res = pair;
+        last = pair;
+      }
+      if (item && (item = get_item(in)) != 0) SET_CDR(last, item);
+      GC_UNROOT(3);
+      return item ? res : 0;
+    case FASL_VECT:
+      if (!get_number(in, &n) || n > (uint64_t)(in->end - in->p)) return 0;
+      res = make_vector(n, 1);
+      GC_ROOT(res);
+      for (uint64_t i = 0; i < n && res; i++) {
+        if ((item = get_item(in)) == 0) res = 0;
+        else VECTOR_START(res)[i] = item;
+      }
+      GC_UNROOT(1);
+      return res;
+    case FASL_GLOBAL:
+    case FASL_DEFINE:
+      if ((name = get_name(in, &n)) == 0) return 0;
+      if (tag == FASL_DEFINE) {
+        add_symbol(name, n, &slot, &global_frame);
+      } else if (!find_symbol(name, n, &slot, &global_frame)) {
+        printf("Undefined variable: %.*s\n", (int)n, name);
+        in->undefined = 1;
+        return 0;
+      }
+      if (in->num_globals == in->max_globals) {
+        in->max_globals = in->max_globals ? in->max_globals*2 : 256;
+        in->global_slots = realloc(in->global_slots,
+                                   in->max_globals*sizeof(uint32_t));
+        if (in->global_slots == 0)
+          die("couldn't alloc memory for a fasl cache");
+      }
+      in->global_slots[in->num_globals++] = slot;
+      return store_var(slot, global_frame);
+    case FASL_GLOBALREF:
+      if (!get_number(in, &n) || n >= in->num_globals) return 0;
+      return store_var(in->global_slots[n], GLOBAL_FRAME);
+    case FASL_VAR:
+      if (!get_number(in, &frame) || !get_number(in, &n) ||
+          frame >= GLOBAL_FRAME || n > UINT32_MAX)
+        return 0;
+      return store_var(n, frame);
+    case FASL_FUNC:
+      if (in->end - in->p < sizeof(uint64_t)) return 0;
+      memcpy(&header, in->p, sizeof(uint64_t));
+      in->p += sizeof(uint64_t);
+      if ((header & TYPE_MASK) != T_FUNC || (header & BLTIN_MASK)) return 0;
+      if ((res = get_item(in)) == 0) return 0;
+      if (use_vm) res = compile_body(res);
+      GC_ROOT(res);
+      CHECK_CELLS(2);
+      GC_UNROOT(1);
+      STAT(stats.cells[T_FUNC] += 2);
+      item = next_cell;
+      cells[next_cell++] = header;
+      cells[next_cell++] = (uint64_t)res;
+      return item;
+    case FASL_BIG:
+      if (!get_number(in, &negative) || !get_number(in, &n) ||
+          n > (uint64_t)(in->end - in->p))
+        return 0;
+      digits = malloc(n*sizeof(uint32_t) + 1);
+      if (digits == 0) die("couldn't alloc memory for a fasl cache");
+      for (uint64_t i = 0; i < n && digits; i++) {
+        uint64_t digit;
+        if (!get_number(in, &digit) || digit > UINT32_MAX) {
+          free(digits);
+          digits = 0;
+        } else digits[i] = digit;
+      }
+      if (digits == 0) return 0;
+      res = store_bignum(digits, n, negative != 0);
+      free(digits);
+      return res;
+    case FASL_FLO:
+      if (in->end - in->p < sizeof(uint64_t)) return 0;
+      memcpy(&flo.bits, in->p, sizeof(uint64_t));
+      in->p += sizeof(uint64_t);
+      return store_flonum(flo.value);
+    default:
+      return 0;
+  }
+}
+
+/* Runs the forms cached for the source text of path, if there's a
+   cache and it's for this text. Returns -1 if there isn't, else whether
+   they all ran. */
+int fasl_load(const char *path, const char *text, size_t size) {
+  char *fasl_path = cache_path(path);
+  FILE *file = fopen(fasl_path, "rb");
+  free(fasl_path);
+  if (file == 0) return -1;
+  struct fasl_header header;
+  unsigned char *data = 0;
+  long data_size = -1;
+  if (fread(&header, sizeof(header), 1, file) == 1 &&
+      memcmp(header.magic, FASL_MAGIC, sizeof(header.magic)) == 0 &&
+      header.version == FASL_VERSION && header.source_size == size &&
+      header.source_hash == hash_source(text, size) &&
+      fseek(file, 0, SEEK_END) == 0 && (data_size = ftell(file)) >= 0) {
+    data_size -= sizeof(header);
+    data = malloc(data_size + 1);
+    if (data == 0) die("couldn't alloc memory for a fasl cache");
+    if (data_size < 0 || fseek(file, sizeof(header), SEEK_SET) != 0 ||
+        fread(data, 1, data_size, file) != data_size) {
+      free(data);
+      data = 0;
+    }
+  }
+  fclose(file);
+  if (data == 0) return -1;
+
+  struct fasl_in in = {data, data + data_size, 0, 0, 0, 0};
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < header.forms; i++) {
+    uint32_t form = get_item(&in);
+    if (form == 0) {
+      if (in.undefined) printf("failed preparing.\n");
+      else printf("damaged cache for %s\n", path);
+      ok = 0;
+    } else if (!eval_prepared(form)) ok = 0;
+  }
+  free(data);
+  free(in.global_slots);
+  return ok;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* The heap. We reserve address space for the largest heap we may ever
+   need, without backing it with memory, and make it usable in chunks
+   as it grows. That way cells never moves, and a small job only pays
+   for what it uses. */
+
+uint64_t *cells = 0;
+uint64_t heap_size = 0;        /* committed cells */
+static uint64_t heap_max = 0;  /* reserved cells */
+
+/* commit in multiples of this many cells (512K) */
+#define HEAP_CHUNK (1 << 16)
+#define ROUND_CHUNK(n) (((n) + HEAP_CHUNK - 1) / HEAP_CHUNK * HEAP_CHUNK)
+
+/* indices are 32-bit, and the frame stack takes the top of the range */
+#define FRAME_CELLS (1 << 20)
+#define HEAP_LIMIT (((uint64_t)1 << 32) - FRAME_CELLS)
+
+/* The frame stack holds environments of calls that nothing can
+   capture (see prepare_lambda()). It lives right after the heap in the
+   same reservation, so its environments are ordinary cell indices, but
+   the collector never moves them: nothing on the heap refers to them,
+   and they're pushed and popped in call order. */
+uint32_t frame_base = 0, frame_top = 0, frame_limit = 0;
+
+static void commit_cells(uint64_t size) {
+  if (size > heap_max) size = heap_max;
+  if (size <= heap_size) return;
+  if (mprotect(cells+heap_size, (size-heap_size)*sizeof(uint64_t),
+               PROT_READ | PROT_WRITE) != 0)
+    die("couldn't commit memory for the heap");
+  heap_size = size;
+}
+
+void heap_init(uint64_t initial, uint64_t max, int hugepages) {
+  if (max == 0 || max > HEAP_LIMIT) max = HEAP_LIMIT;
+  if (initial < HEAP_CHUNK) initial = HEAP_CHUNK;
+  max = ROUND_CHUNK(max);
+  if (initial > max) initial = max;
+
+  /* address space may be limited; settle for less if we have to */
+  void *p = MAP_FAILED;
+  while (max >= initial) {
+    p = mmap(0, (max+FRAME_CELLS)*sizeof(uint64_t), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) break;
+    max = ROUND_CHUNK(max/2);
+  }
+  if (p == MAP_FAILED) die("couldn't reserve memory for the heap");
+  cells = p;
+  heap_max = max;
+#ifdef MADV_HUGEPAGE
+  if (hugepages) madvise(cells, heap_max*sizeof(uint64_t), MADV_HUGEPAGE);
+#endif
+  commit_cells(ROUND_CHUNK(initial));
+
+  /* pages of the frame stack only get memory once touched */
+  if (mprotect(cells+heap_max, FRAME_CELLS*sizeof(uint64_t),
+               PROT_READ | PROT_WRITE) != 0)
+    die("couldn't commit memory for the frame stack");
+  frame_base = frame_top = heap_max;
+  /* stop short of the end, so that frame_top never wraps around */
+  frame_limit = heap_max + FRAME_CELLS - 2;
+}
+
+/* The garbage collector. It's a sliding mark-compact collector
+   working directly over cells[]: live values are marked starting from
+   the roots, then slid down towards the start of the heap in their
+   original order, and all references to them are updated. Keeping the
+   order means values allocated together (a list and its elements, an
+   environment and the closures made in it) stay together.
+
+   The collector needs to walk the heap linearly, so every allocated
+   value must start with a header cell from which its size can be
+   computed; see value_size(). Immediates aren't on the heap and are
+   left alone. */
+
+struct gc_root *gc_roots = 0;
+uint32_t gc_num_roots = 0, gc_max_roots = 0;
+
+void gc_grow_roots(void) {
+  gc_max_roots = gc_max_roots ? gc_max_roots*2 : 1024;
+  gc_roots = realloc(gc_roots, gc_max_roots*sizeof(struct gc_root));
+  if (gc_roots == 0) die("couldn't alloc memory for gc roots");
+}
+
+/* globals holding cell indices, e.g. well-known symbols */
+#define MAX_GLOBAL_ROOTS 64
+static uint32_t *global_roots[MAX_GLOBAL_ROOTS];
+static uint32_t num_global_roots = 0;
+
+void gc_add_global(uint32_t *ptr) {
+  if (num_global_roots == MAX_GLOBAL_ROOTS) die("too many global gc roots");
+  global_roots[num_global_roots++] = ptr;
+}
+
+#define MAX_VISITORS 16
+static gc_visitor_t visitors[MAX_VISITORS];
+static uint32_t num_visitors = 0;
+
+void gc_add_visitor(gc_visitor_t visitor) {
+  if (num_visitors == MAX_VISITORS) die("too many gc visitors");
+  visitors[num_visitors++] = visitor;
+}
+
+/* number of cells taken by the value starting at index, padding
+   included */
+static uint32_t value_size(uint32_t index) {
+  switch(TYPE(index)) {
+    case T_STR:
+    case T_SYM:
+      return CELLS_EVEN(1 + (STR_LEN(index)+7)/8);
+    case T_VECT:
+      return CELLS_EVEN(1 + (VECTOR_LEN(index)+1)/2);
+    case T_BIG:
+      return CELLS_EVEN(1 + (BIG_LEN(index)+1)/2);
+    case T_CODE:
+      return CELLS_EVEN(2 + (CODE_LEN(index)+1)/2);
+    case T_NVEC:
+      return nvector_cells(NVEC_KIND(index), NVEC_LEN(index));
+    default:
+      return 2;
+  }
+}
+
+/* During collection, forward[i] is 0 for dead values, nonzero for
+   marked ones, and once addresses are computed, the new index of a
+   live value that currently starts at i. */
+static uint32_t *forward;
+
+static uint32_t *mark_stack;
+static uint32_t mark_top, mark_max;
+
+static void push_mark(uint32_t index) {
+  if (index < C_STARTFROM || IMMEDIATE(index) || index >= frame_base ||
+      forward[index]) return;
+  if (index >= next_cell) die("gc: reference past the end of the heap");
+  forward[index] = 1;
+  if (mark_top == mark_max) {
+    mark_max = mark_max ? mark_max*2 : 4096;
+    mark_stack = realloc(mark_stack, mark_max*sizeof(uint32_t));
+    if (mark_stack == 0) die("couldn't alloc memory for the gc mark stack");
+  }
+  mark_stack[mark_top++] = index;
+}
+
+static void mark_children(uint32_t index) {
+  uint32_t len, *elements;
+  switch(TYPE(index)) {
+    case T_FUNC:
+      if (cells[index] & BLTIN_MASK) break;  /* a C pointer, not indices */
+      /* fall through: env and body are laid out like car and cdr */
+    case T_CODE:  /* and so are constants and source */
+    case T_BUILDER:  /* and its buffer */
+    case T_PAIR:
+      push_mark(CAR(index));
+      push_mark(CDR(index));
+      break;
+    case T_VECT:
+      len = VECTOR_LEN(index); elements = VECTOR_START(index);
+      for (uint32_t i = 0; i < len; i++) push_mark(elements[i]);
+      break;
+    default:
+      break;
+  }
+}
+
+static void mark_root(uint32_t *ptr) {
+  push_mark(*ptr);
+}
+
+static void mark_all(void) {
+  for (uint32_t i = 0; i < num_visitors; i++) visitors[i](mark_root);
+  uint32_t num_symbols, *symbols = interned_symbols(&num_symbols);
+  for (uint32_t i = 0; i < num_symbols; i++) push_mark(symbols[i]);
+  for (uint32_t i = 0; i < num_global_roots; i++) push_mark(*global_roots[i]);
+  for (uint32_t i = 0; i < gc_num_roots; i++) {
+    for (uint32_t j = 0; j < gc_roots[i].count; j++)
+      push_mark(gc_roots[i].ptr[j]);
+  }
+  for (uint32_t i = frame_base; i < frame_top; i += value_size(i)) {
+    for (uint32_t j = 0; j < VECTOR_LEN(i); j++)
+      push_mark(VECTOR_START(i)[j]);
+  }
+  while (mark_top > 0) mark_children(mark_stack[--mark_top]);
+}
+
+static uint32_t new_index(uint32_t index) {
+  if (index < C_STARTFROM || IMMEDIATE(index) || index >= frame_base)
+    return index;
+  return forward[index];
+}
+
+static void update_root(uint32_t *ptr) {
+  *ptr = new_index(*ptr);
+}
+
+static void update_children(uint32_t index) {
+  uint32_t len, *elements;
+  switch(TYPE(index)) {
+    case T_FUNC:
+      if (cells[index] & BLTIN_MASK) break;
+      /* fall through */
+    case T_CODE:
+    case T_BUILDER:
+    case T_PAIR:
+      cells[index+1] = (uint64_t)new_index(CAR(index)) << 32 |
+                       new_index(CDR(index));
+      break;
+    case T_VECT:
+      len = VECTOR_LEN(index); elements = VECTOR_START(index);
+      for (uint32_t i = 0; i < len; i++) elements[i] = new_index(elements[i]);
+      break;
+    default:
+      break;
+  }
+}
+
+static void collect(void) {
+  uint32_t i, size, free_cell;
+
+  forward = calloc(next_cell, sizeof(uint32_t));
+  if (forward == 0) die("couldn't alloc memory for gc");
+  mark_all();
+
+  /* compute new addresses, preserving the order */
+  free_cell = C_STARTFROM;
+  for (i = C_STARTFROM; i < next_cell; i += size) {
+    size = value_size(i);
+    if (forward[i]) {
+      forward[i] = free_cell;
+      free_cell += size;
+    }
+  }
+
+  /* update references, while values are still in their old places */
+  for (i = 0; i < num_visitors; i++) visitors[i](update_root);
+  uint32_t num_symbols, *symbols = interned_symbols(&num_symbols);
+  for (i = 0; i < num_symbols; i++) symbols[i] = new_index(symbols[i]);
+  for (i = 0; i < num_global_roots; i++)
+    *global_roots[i] = new_index(*global_roots[i]);
+  for (i = 0; i < gc_num_roots; i++) {
+    for (uint32_t j = 0; j < gc_roots[i].count; j++)
+      gc_roots[i].ptr[j] = new_index(gc_roots[i].ptr[j]);
+  }
+  for (i = frame_base; i < frame_top; i += value_size(i)) update_children(i);
+  for (i = C_STARTFROM; i < next_cell; i += value_size(i)) {
+    if (forward[i]) update_children(i);
+  }
+
+  /* slide live values down; a value never moves past its old start,
+     so nothing we haven't reached yet gets overwritten */
+  for (i = C_STARTFROM; i < next_cell; i += size) {
+    size = value_size(i);
+    if (forward[i] && forward[i] != i)
+      memmove(cells+forward[i], cells+i, size*sizeof(uint64_t));
+  }
+
+  next_cell = free_cell;
+  free(forward);
+  forward = 0;
+}
+
+/* For --stats: cells allocated before the last collection, and where
+   next_cell was right after it. */
+static uint64_t cells_allocated = 0;
+static uint32_t cells_after_gc = C_STARTFROM;
+uint64_t gc_count = 0;
+
+uint64_t gc_cells_allocated(void) {
+  return cells_allocated + next_cell - cells_after_gc;
+}
+
+/* Collect, then grow the heap if it's still more than half full, so
+   that a growing working set doesn't make us collect all the time. */
+void gc_collect(uint32_t needed) {
+  cells_allocated += next_cell - cells_after_gc;
+  gc_count++;
+  collect();
+  cells_after_gc = next_cell;
+  uint64_t wanted = (uint64_t)next_cell + needed + 1;
+  if (wanted > heap_size/2) {
+    uint64_t size = heap_size*2;
+    if (size < wanted) size = wanted;
+    commit_cells(ROUND_CHUNK(size));
+  }
+  if (HEAP_FULL(needed)) die("out of cells");
+}
+
+/* Replaces the heap with count cells saved in a file at offset (see
+   image.c). Where the offset is page aligned, the file is mapped over
+   the heap copy-on-write, so pages are only read once touched and only
+   copied once written; otherwise it's read in. */
+int heap_load(int fd, uint64_t offset, uint32_t count) {
+  uint64_t bytes = (uint64_t)count*sizeof(uint64_t);
+  long page = sysconf(_SC_PAGESIZE);
+  if (count > heap_max) return 0;
+  commit_cells(ROUND_CHUNK((uint64_t)count + 1));
+  if (page > 0 && offset % page == 0) {
+    /* whole pages; the end of the last one, past the file, reads as
+       zeros */
+    uint64_t mapped = (bytes + page-1) / page * page;
+    if (mmap(cells, mapped, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+      return 0;
+  } else {
+    if (lseek(fd, offset, SEEK_SET) < 0) return 0;
+    for (uint64_t done = 0; done < bytes; ) {
+      ssize_t n = read(fd, (char *)cells + done, bytes - done);
+      if (n <= 0) return 0;
+      done += n;
+    }
+  }
+  next_cell = cells_after_gc = count;
+  return 1;
+}
@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L  /* for fstat(), sysconf() */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Heap images. (save-image "file") writes out everything a session has
+   built up: the used part of cells[], the globals and the symbol
+   tables. sketch --image file starts from there instead of from
+   scratch, mapping the cells in rather than reading and evaluating
+   anything.
+
+   The file is a header, the builtins' locations on the heap, globals[],
+   the symbol tables (see save_symbols()), then the cells, starting on a
+   page boundary so that they can be mapped straight in. The cells are
+   as they are in memory, except that builtins' function pointers are
+   only good in the process that saved them: the locations are the
+   relocation table that tells the loader where to put its own. An image
+   only goes with the build that saved it, which the header checks. */
+
+#define IMAGE_MAGIC "sketchim"
+#define IMAGE_VERSION 2
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t use_vm;        /* lambda bodies are compiled, or not */
+  uint32_t builtins;      /* their number, and a hash of their names */
+  uint32_t builtin_hash;
+  uint32_t next_cell;
+  uint32_t globals;
+  uint64_t symbols_size;
+  uint64_t heap_offset;   /* where the cells start in the file */
+};
+
+/* FNV-1a over the builtins' names, in register order */
+static uint32_t hash_builtins(void) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < builtin_count(); i++) {
+    for (const char *p = builtin_name(i); ; p++) {
+      hash ^= (unsigned char)*p;
+      hash *= 16777619u;
+      if (*p == '\0') break;
+    }
+  }
+  return hash;
+}
+
+static void fill_header(struct image_header *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+  header->version = IMAGE_VERSION;
+  header->use_vm = use_vm;
+  header->builtins = builtin_count();
+  header->builtin_hash = hash_builtins();
+}
+
+int write_image(const char *path) {
+  /* what's garbage now needn't be saved, or mapped in every time */
+  gc_collect(0);
+
+  FILE *file = fopen(path, "w");
+  if (file == 0) {
+    printf("can't open %s\n", path);
+    return 0;
+  }
+  struct image_header header;
+  fill_header(&header);
+  header.next_cell = next_cell;
+  header.globals = global_slots();
+  size_t symbols_size;
+  void *symbols = save_symbols(&symbols_size);
+  header.symbols_size = symbols_size;
+  uint64_t offset = sizeof(header) + header.builtins*sizeof(uint32_t) +
+                    header.globals*sizeof(uint32_t) + symbols_size;
+  long page = sysconf(_SC_PAGESIZE);
+  if (page <= 0) page = 4096;
+  header.heap_offset = (offset + page-1) / page * page;
+
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(builtin_locations(), sizeof(uint32_t), header.builtins, file)
+      == header.builtins &&
+    fwrite(globals, sizeof(uint32_t), header.globals, file)
+      == header.globals &&
+    fwrite(symbols, 1, symbols_size, file) == symbols_size;
+  for (; ok && offset < header.heap_offset; offset++)
+    ok = putc(0, file) != EOF;
+  ok = ok && fwrite(cells, sizeof(uint64_t), next_cell, file) == next_cell;
+  free(symbols);
+  if (fclose(file) != 0) ok = 0;
+  if (!ok) printf("couldn't write %s\n", path);
+  return ok;
+}
+
+static int read_all(int fd, void *buf, size_t size) {
+  for (size_t done = 0; done < size; ) {
+    ssize_t n = read(fd, (char *)buf + done, size - done);
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
+}
+
+/* Replaces the state init_sketch() set up with the image's. Nothing
+   must be running: only the globals and what they reach survive. */
+int read_image(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("can't open %s\n", path);
+    return 0;
+  }
+  struct image_header header, expected;
+  struct stat st;
+  uint32_t *locations = 0, *saved_globals = 0;
+  void *symbols = 0;
+  int ok = 0;
+  const char *problem = "is not a sketch image";
+  fill_header(&expected);
+  if (!read_all(fd, &header, sizeof(header)) ||
+      memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size < header.heap_offset +
+                             (uint64_t)header.next_cell*sizeof(uint64_t))
+    goto done;
+  problem = "was saved by a different build of sketch";
+  if (header.version != expected.version ||
+      header.builtins != expected.builtins ||
+      header.builtin_hash != expected.builtin_hash)
+    goto done;
+  problem = header.use_vm ? "needs the compiler, not --tree-walk"
+                          : "was saved with --tree-walk";
+  if (header.use_vm != expected.use_vm) goto done;
+
+  problem = "is damaged";
+  locations = malloc(header.builtins*sizeof(uint32_t));
+  saved_globals = malloc(header.globals*sizeof(uint32_t) + 1);
+  symbols = malloc(header.symbols_size + 1);
+  if (locations == 0 || saved_globals == 0 || symbols == 0)
+    die("couldn't alloc memory for an image");
+  if (!read_all(fd, locations, header.builtins*sizeof(uint32_t)) ||
+      !read_all(fd, saved_globals, header.globals*sizeof(uint32_t)) ||
+      !read_all(fd, symbols, header.symbols_size) ||
+      header.next_cell < C_STARTFROM)
+    goto done;
+  /* past here, the old state is gone; a failure can only be fatal */
+  if (!heap_load(fd, header.heap_offset, header.next_cell))
+    die("couldn't map an image into the heap");
+  if (!relocate_builtins(locations) ||
+      !load_symbols(symbols, header.symbols_size))
+    die("damaged image");
+  reserve_globals(header.globals);
+  memcpy(globals, saved_globals, header.globals*sizeof(uint32_t));
+  intern_keywords();
+  ok = 1;
+
+done:
+  if (!ok) printf("%s %s\n", path, problem);
+  free(locations); free(saved_globals); free(symbols);
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L  /* for getline() */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "common.h"
+
+/* The sketch program: the REPL and batch mode, on top of the
+   interpreter in sketch.c. */
+
+/* Whether the input so far ends inside a list or a string, based on
+   parens parity. It's kept across calls, so that each new line of a
+   long form is the only thing scanned. */
+struct input_state {
+  int paren_level, in_string;
+};
+
+int in_flight(struct input_state *state, char *str) {
+  while (*str) {
+    if (state->in_string) {
+      if (*str == '\\' && *(str+1)) str++;
+      else if (*str == '"') state->in_string = 0;
+    } else if (*str == ';') {
+      while (*(str+1) && *(str+1) != '\n') str++;
+    } else if (*str == '#' && *(str+1) == '\\') {
+      str += 2;
+      if (!*str) break;
+    } else if (*str == '"') {
+      state->in_string = 1;
+    } else if (*str == '(') {
+      state->paren_level++;
+    } else if (*str == ')' && state->paren_level > 0) {
+      state->paren_level--;
+    }
+    str++;
+  }
+  return (state->paren_level > 0 || state->in_string);
+}
+
+/* The interactive loop: reads whole forms, however many lines they
+   take, and prints the value of each. */
+void repl(void) {
+  char *line = 0, *text = 0;
+  size_t line_max = 0, size, max_size = 0;
+  ssize_t count;
+  struct input_state state;
+  while(1) {
+    printf("%d cells> ", next_cell);
+    size = 0;
+    memset(&state, 0, sizeof(state));
+    while(1) {
+      if ((count = getline(&line, &line_max, stdin)) < 0) {
+        if (!feof(stdin)) die("reading stdin failed");
+        free(line); free(text);
+        return;
+      }
+      if (size + count + 1 > max_size) {
+        max_size = (size + count + 1) * 2;
+        text = realloc(text, max_size);
+        if (text == 0) die("couldn't alloc memory for input");
+      }
+      memcpy(text+size, line, count+1);
+      if (in_flight(&state, text+size)) {
+        size += count;
+        printf("... ");
+        continue;  /* read more */
+      }
+      break;
+    }
+    char *str = text;
+    uint32_t index;
+    while(1) {
+      str = skip_space(str);
+      if (*str == '\0') break;
+      if (!read_value(&str, &index, 0)) {
+        printf("failed reading at: %s\n", str);
+        break;
+      }
+      uint32_t res = eval_toplevel(index);
+      if (res) {
+        dump_value(res, 0); printf("\n");
+      }
+    }
+  }
+}
+
+/* a heap size in bytes, with an optional k/m/g suffix; returns cells */
+uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t size = strtoull(str, &end, 10);
+  switch (tolower(*end)) {
+    case 'g': size <<= 10;  /* fall through */
+    case 'm': size <<= 10;  /* fall through */
+    case 'k': size <<= 10; end++; break;
+    default: break;
+  }
+  if (end == str || *end != '\0') die("bad heap size");
+  return size / sizeof(uint64_t);
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: sketch [--heap SIZE] [--heap-max SIZE] "
+                  "[--hugepages] [--tree-walk] [--stats]\n"
+                  "              [--profile OUT] [--alloc-profile] "
+                  "[--image IMAGE]\n"
+                  "              [--no-fasl] [--simd LEVEL] [FILE]\n"
+                  "With a FILE, evaluates the forms in it quietly and "
+                  "exits; otherwise\nreads forms from the input and "
+                  "prints their values.\n"
+                  "--stats prints allocation and call statistics at exit.\n"
+                  "--profile samples where time goes, prints a flat "
+                  "profile at exit,\nand writes collapsed stacks for "
+                  "a flame graph to OUT.\n"
+                  "--alloc-profile prints where cells get allocated, "
+                  "at exit.\n"
+                  "--image starts from a heap image written by "
+                  "(save-image \"IMAGE\").\n"
+                  "--no-fasl makes load neither use nor write FILE.fasl "
+                  "caches.\n"
+                  "--simd keeps numeric vectors' kernels to avx2, sse2 "
+                  "or scalar,\nwhere the processor can do better.\n");
+  fprintf(stderr, "--tree-walk evaluates without the VM; calls not in "
+                  "tail position nest\nat most %d deep there.\n",
+                  MAX_EVAL_DEPTH);
+  fprintf(stderr, "SIZE is in bytes, with an optional k/m/g suffix. "
+                  "The same can be set\nwith SKETCH_HEAP, SKETCH_HEAP_MAX, "
+                  "SKETCH_HUGEPAGES, SKETCH_TREE_WALK,\nSKETCH_STATS, "
+                  "SKETCH_PROFILE, SKETCH_ALLOC_PROFILE, SKETCH_IMAGE,\n"
+                  "SKETCH_NO_FASL and SKETCH_SIMD in the environment.\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint64_t heap_initial = 1000000, heap_max = 0;
+  int hugepages = 0, show_stats = 0, alloc_profile = 0;
+  char *env, *path = 0, *profile = 0, *image = 0;
+  if ((env = getenv("SKETCH_HEAP")) != 0) heap_initial = parse_size(env);
+  if ((env = getenv("SKETCH_HEAP_MAX")) != 0) heap_max = parse_size(env);
+  if ((env = getenv("SKETCH_HUGEPAGES")) != 0) hugepages = atoi(env);
+  if ((env = getenv("SKETCH_TREE_WALK")) != 0) use_vm = !atoi(env);
+  if ((env = getenv("SKETCH_STATS")) != 0) show_stats = atoi(env);
+  if ((env = getenv("SKETCH_PROFILE")) != 0 && *env) profile = env;
+  if ((env = getenv("SKETCH_ALLOC_PROFILE")) != 0)
+    alloc_profile = atoi(env);
+  if ((env = getenv("SKETCH_IMAGE")) != 0 && *env) image = env;
+  if ((env = getenv("SKETCH_NO_FASL")) != 0) use_fasl = !atoi(env);
+  if ((env = getenv("SKETCH_SIMD")) != 0 && *env && !set_simd(env)) usage();
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--heap") == 0 && i+1 < argc) {
+      heap_initial = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--heap-max") == 0 && i+1 < argc) {
+      heap_max = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--hugepages") == 0) {
+      hugepages = 1;
+    } else if (strcmp(argv[i], "--tree-walk") == 0) {
+      use_vm = 0;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      show_stats = 1;
+    } else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+      profile = argv[++i];
+    } else if (strcmp(argv[i], "--alloc-profile") == 0) {
+      alloc_profile = 1;
+    } else if (strcmp(argv[i], "--no-fasl") == 0) {
+      use_fasl = 0;
+    } else if (strcmp(argv[i], "--simd") == 0 && i+1 < argc) {
+      if (!set_simd(argv[++i])) usage();
+    } else if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+      image = argv[++i];
+    } else if (argv[i][0] != '-' && path == 0) {
+      path = argv[i];
+    } else usage();
+  }
+  if (show_stats) atexit(print_stats);
+  init_sketch(heap_initial, heap_max, hugepages);
+  if (image && !read_image(image)) return 1;
+  if (profile) profile_start(profile);
+  if (alloc_profile) alloc_profile_start();
+
+  if (path) return load_file(path, 0) ? 0 : 1;
+  repl();
+  return 0;
+}
+
@@ -0,0 +1,240 @@
+#define _POSIX_C_SOURCE 200809L  /* for clock_gettime(), dup() */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Times the reader, the preparer, the evaluator and the printer each on
+   its own, on synthetic inputs, and reports ns and cells allocated per
+   operation. Unlike bench/, this doesn't go through the REPL, so a
+   change to a helper shows up in the stage that uses it.
+
+   usage: microbench [--vm] [NAME...]
+   With NAMEs, runs only the benchmarks whose names contain one of them.
+   With --vm, lambdas are compiled and eval runs the bytecode. */
+
+/* each benchmark repeats until it's taken this long */
+#define MIN_NS 200000000LL
+
+static FILE *out;  /* stdout; the real one is /dev/null, for the printer */
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Inputs. Each is program text, built once, that reads as a single
+   form. */
+
+struct input {
+  const char *name;
+  char *text;
+};
+
+static char *text = 0;
+static size_t text_size = 0, text_max = 0;
+
+static void append(const char *fmt, int n) {
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), fmt, n);
+  if (text_size + len + 1 > text_max) {
+    text_max = (text_size + len + 1) * 2;
+    text = realloc(text, text_max);
+    if (text == 0) die("couldn't alloc memory for an input");
+  }
+  memcpy(text+text_size, buf, len+1);
+  text_size += len;
+}
+
+static char *take_text(void) {
+  char *res = text;
+  text = 0; text_size = text_max = 0;
+  return res;
+}
+
+/* (+ 1 (+ 1 ... (+ 1 0))), nested depth times */
+static char *deep_input(int depth) {
+  for (int i = 0; i < depth; i++) append("(+ %d ", 1);
+  append("%d", 0);
+  for (int i = 0; i < depth; i++) append(")", 0);
+  return take_text();
+}
+
+/* #(0 1 ... len-1) */
+static char *wide_input(int len) {
+  append("#(", 0);
+  for (int i = 0; i < len; i++) append(i ? " %d" : "%d", i);
+  append(")", 0);
+  return take_text();
+}
+
+/* "abcd...", len characters */
+static char *string_input(int len) {
+  append("\"", 0);
+  for (int i = 0; i < len; i++) append("%c", 'a' + i % 26);
+  append("\"", 0);
+  return take_text();
+}
+
+/* ((lambda (v0 ... vn-1) (cons v0 vn-1) ... (list v0 ... vn-1)) 0 ... n-1)
+   A lambda with many variables, all referred to many times. */
+static char *symbols_input(int n) {
+  append("((lambda (", 0);
+  for (int i = 0; i < n; i++) append(i ? " v%d" : "v%d", i);
+  append(")", 0);
+  for (int i = 0; i < n; i++) {
+    append(" (cons v%d", i);
+    append(" v%d)", n-1-i);
+  }
+  append(" (list", 0);
+  for (int i = 0; i < n; i++) append(" v%d", i);
+  append("))", 0);
+  for (int i = 0; i < n; i++) append(" %d", i);
+  append(")", 0);
+  return take_text();
+}
+
+static uint32_t read_input(struct input *input) {
+  char *str = input->text;
+  uint32_t index;
+  if (!read_value(&str, &index, 0)) die("microbench: can't read an input");
+  return index;
+}
+
+/* Timing. Operations repeat until MIN_NS has passed, and only the time
+   inside the stage counts. */
+
+static void report(const char *stage, struct input *input,
+                   int64_t ns, uint64_t cells, uint64_t ops) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s %s", stage, input->name);
+  fprintf(out, "%-18s %12.0f %12.1f\n", name, (double)ns / ops,
+          (double)cells / ops);
+}
+
+static void bench_read(struct input *input) {
+  int64_t ns = 0;
+  uint64_t ops = 0, cells = gc_cells_allocated();
+  while (ns < MIN_NS) {
+    int64_t start = now_ns();
+    read_input(input);
+    ns += now_ns() - start;
+    ops++;
+  }
+  report("read", input, ns, gc_cells_allocated() - cells, ops);
+}
+
+/* prepare() changes a form in place, so each op needs a fresh copy,
+   read in batches outside the timing. Preparing may take far less than
+   reading, so it's the total time that's limited. */
+#define BATCH 64
+static void bench_prepare(struct input *input) {
+  uint32_t forms[BATCH];
+  int64_t ns = 0, end = now_ns() + MIN_NS;
+  uint64_t ops = 0, cells = 0;
+  GC_ROOTS(forms, BATCH);
+  while (now_ns() < end) {
+    for (int i = 0; i < BATCH; i++) forms[i] = 0;
+    for (int i = 0; i < BATCH; i++) forms[i] = read_input(input);
+    uint64_t before = gc_cells_allocated();
+    int64_t start = now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      if (!prepare(forms[i], 0)) die("microbench: can't prepare an input");
+    }
+    ns += now_ns() - start;
+    cells += gc_cells_allocated() - before;
+    ops += BATCH;
+  }
+  GC_UNROOT(1);
+  report("prepare", input, ns, cells, ops);
+}
+
+static void bench_eval(struct input *input) {
+  uint32_t form = read_input(input);
+  GC_ROOT(form);
+  form = prepare(form, 0);
+  if (!form) die("microbench: can't prepare an input");
+  if (use_vm) form = compile_toplevel(form);
+  int64_t ns = 0;
+  uint64_t ops = 0, cells = gc_cells_allocated();
+  while (ns < MIN_NS) {
+    int64_t start = now_ns();
+    uint32_t res = use_vm ? vm_run(form, 0) : eval(form, 0);
+    ns += now_ns() - start;
+    if (!res) die("microbench: can't eval an input");
+    ops++;
+  }
+  GC_UNROOT(1);
+  report("eval", input, ns, gc_cells_allocated() - cells, ops);
+}
+
+static void bench_print(struct input *input) {
+  uint32_t form = read_input(input);
+  GC_ROOT(form);
+  int64_t ns = 0;
+  uint64_t ops = 0, cells = gc_cells_allocated();
+  while (ns < MIN_NS) {
+    int64_t start = now_ns();
+    dump_value(form, 0);
+    fflush(stdout);
+    ns += now_ns() - start;
+    ops++;
+  }
+  GC_UNROOT(1);
+  report("print", input, ns, gc_cells_allocated() - cells, ops);
+}
+
+static int selected(const char *stage, struct input *input,
+                    int argc, char **argv) {
+  char name[64];
+  int any = 0;
+  snprintf(name, sizeof(name), "%s %s", stage, input->name);
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') continue;
+    any = 1;
+    if (strstr(name, argv[i])) return 1;
+  }
+  return !any;
+}
+
+int main(int argc, char **argv) {
+  use_vm = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--vm") == 0) use_vm = 1;
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: microbench [--vm] [NAME...]\n");
+      return 1;
+    }
+  }
+  /* the printer writes to stdout; keep the report apart */
+  out = fdopen(dup(1), "w");
+  if (out == 0 || freopen("/dev/null", "w", stdout) == 0)
+    die("microbench: can't redirect stdout");
+  init_sketch(1000000, 0, 0);
+
+  struct input inputs[] = {
+    {"deep", deep_input(500)},
+    {"wide", wide_input(10000)},
+    {"string", string_input(10000)},
+    {"symbols", symbols_input(200)},
+  };
+  const char *stages[] = {"read", "prepare", "eval", "print"};
+  void (*benches[])(struct input *) = {
+    bench_read, bench_prepare, bench_eval, bench_print
+  };
+
+  fprintf(out, "%-18s %12s %12s\n", "bench", "ns/op", "cells/op");
+  for (int s = 0; s < 4; s++) {
+    for (int i = 0; i < sizeof(inputs)/sizeof(inputs[0]); i++) {
+      if (!selected(stages[s], &inputs[i], argc, argv)) continue;
+      benches[s](&inputs[i]);
+      fflush(out);
+    }
+  }
+  return 0;
+}
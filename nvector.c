@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#else
+#define X86 0
+#endif
+
+#include "common.h"
+
+/* Numeric vectors, after SRFI 4: s32vectors, f64vectors and bytevectors
+   keep their elements raw in the cells after the header, rather than
+   as indices of boxed values, and have no references for the collector
+   to follow. A million integers take half a million cells, not a
+   million plus the boxes.
+
+   The bulk operations - fill, sum, min and max, elementwise add and
+   scale, dot product - go through a table of kernels, picked once at
+   startup for what the processor can do (CPUID, by way of
+   __builtin_cpu_supports()): AVX2, SSE2, or plain C. Flonum sums and
+   dot products add in a different order in each, so their last bits
+   can differ between machines; everything else is exact. Copies use
+   memmove(), which the C library already does this way. */
+
+/* Kernels. Lengths are in elements; min and max want at least one. */
+struct kernels {
+  const char *name;
+  void (*fill_s32)(int32_t *d, uint32_t n, int32_t x);
+  void (*fill_f64)(double *d, uint32_t n, double x);
+  int64_t (*sum_s32)(const int32_t *a, uint32_t n);
+  double (*sum_f64)(const double *a, uint32_t n);
+  void (*minmax_s32)(const int32_t *a, uint32_t n, int32_t *min,
+                     int32_t *max);
+  void (*minmax_f64)(const double *a, uint32_t n, double *min, double *max);
+  /* 0 if a sum doesn't fit in 32 bits; r is garbage then */
+  int (*add_s32)(int32_t *r, const int32_t *a, const int32_t *b, uint32_t n);
+  void (*add_f64)(double *r, const double *a, const double *b, uint32_t n);
+  /* the products must fit; the caller checks with minmax_s32 */
+  void (*scale_s32)(int32_t *r, const int32_t *a, uint32_t n, int32_t k);
+  void (*scale_f64)(double *r, const double *a, uint32_t n, double k);
+  double (*dot_f64)(const double *a, const double *b, uint32_t n);
+};
+
+static void fill_s32(int32_t *d, uint32_t n, int32_t x) {
+  for (uint32_t i = 0; i < n; i++) d[i] = x;
+}
+static void fill_f64(double *d, uint32_t n, double x) {
+  for (uint32_t i = 0; i < n; i++) d[i] = x;
+}
+static int64_t sum_s32(const int32_t *a, uint32_t n) {
+  int64_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) sum += a[i];
+  return sum;
+}
+static double sum_f64(const double *a, uint32_t n) {
+  double sum = 0;
+  for (uint32_t i = 0; i < n; i++) sum += a[i];
+  return sum;
+}
+static void minmax_s32(const int32_t *a, uint32_t n, int32_t *min,
+                       int32_t *max) {
+  int32_t lo = a[0], hi = a[0];
+  for (uint32_t i = 1; i < n; i++) {
+    if (a[i] < lo) lo = a[i];
+    if (a[i] > hi) hi = a[i];
+  }
+  *min = lo; *max = hi;
+}
+/* a NaN anywhere makes both NaN */
+static void minmax_f64(const double *a, uint32_t n, double *min,
+                       double *max) {
+  double lo = a[0], hi = a[0];
+  for (uint32_t i = 0; i < n; i++) {
+    if (a[i] != a[i]) { *min = *max = a[i]; return; }
+    if (a[i] < lo) lo = a[i];
+    if (a[i] > hi) hi = a[i];
+  }
+  *min = lo; *max = hi;
+}
+static int add_s32(int32_t *r, const int32_t *a, const int32_t *b,
+                   uint32_t n) {
+  for (uint32_t i = 0; i < n; i++)
+    if (__builtin_add_overflow(a[i], b[i], &r[i])) return 0;
+  return 1;
+}
+static void add_f64(double *r, const double *a, const double *b,
+                    uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) r[i] = a[i] + b[i];
+}
+static void scale_s32(int32_t *r, const int32_t *a, uint32_t n, int32_t k) {
+  for (uint32_t i = 0; i < n; i++) r[i] = a[i] * k;
+}
+static void scale_f64(double *r, const double *a, uint32_t n, double k) {
+  for (uint32_t i = 0; i < n; i++) r[i] = a[i] * k;
+}
+static double dot_f64(const double *a, const double *b, uint32_t n) {
+  double sum = 0;
+  for (uint32_t i = 0; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+static const struct kernels scalar_kernels = {
+  "scalar", fill_s32, fill_f64, sum_s32, sum_f64, minmax_s32, minmax_f64,
+  add_s32, add_f64, scale_s32, scale_f64, dot_f64
+};
+
+#if X86
+/* SSE2 is in every x86-64. It has no 32-bit multiply, or min and max,
+   so those are done with compares here, or left to the plain C. Each
+   kernel finishes the last few elements with the plain C one. */
+
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 static void fill_s32_sse2(int32_t *d, uint32_t n, int32_t x) {
+  __m128i v = _mm_set1_epi32(x);
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) _mm_storeu_si128((__m128i *)(d+i), v);
+  fill_s32(d+i, n-i, x);
+}
+SSE2 static void fill_f64_sse2(double *d, uint32_t n, double x) {
+  __m128d v = _mm_set1_pd(x);
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2) _mm_storeu_pd(d+i, v);
+  fill_f64(d+i, n-i, x);
+}
+SSE2 static int64_t sum_s32_sse2(const int32_t *a, uint32_t n) {
+  /* widened to 64 bits: the sign goes in the upper halves */
+  __m128i sum = _mm_setzero_si128(), zero = _mm_setzero_si128();
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i sign = _mm_cmpgt_epi32(zero, x);
+    sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(x, sign));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(x, sign));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, sum);
+  return lanes[0] + lanes[1] + sum_s32(a+i, n-i);
+}
+SSE2 static double sum_f64_sse2(const double *a, uint32_t n) {
+  __m128d sum = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2) sum = _mm_add_pd(sum, _mm_loadu_pd(a+i));
+  double lanes[2];
+  _mm_storeu_pd(lanes, sum);
+  return lanes[0] + lanes[1] + sum_f64(a+i, n-i);
+}
+SSE2 static void minmax_s32_sse2(const int32_t *a, uint32_t n, int32_t *min,
+                                 int32_t *max) {
+  __m128i lo = _mm_set1_epi32(a[0]), hi = lo;
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i less = _mm_cmpgt_epi32(lo, x), more = _mm_cmpgt_epi32(x, hi);
+    lo = _mm_or_si128(_mm_and_si128(less, x), _mm_andnot_si128(less, lo));
+    hi = _mm_or_si128(_mm_and_si128(more, x), _mm_andnot_si128(more, hi));
+  }
+  /* the lanes, and the rest of a in the last place */
+  int32_t los[5], his[5], unused;
+  _mm_storeu_si128((__m128i *)los, lo);
+  _mm_storeu_si128((__m128i *)his, hi);
+  los[4] = his[4] = a[0];
+  if (i < n) minmax_s32(a+i, n-i, &los[4], &his[4]);
+  minmax_s32(los, 5, min, &unused);
+  minmax_s32(his, 5, &unused, max);
+}
+SSE2 static void minmax_f64_sse2(const double *a, uint32_t n, double *min,
+                                 double *max) {
+  __m128d lo = _mm_set1_pd(a[0]), hi = lo, nan = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a+i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+    lo = _mm_min_pd(lo, x);
+    hi = _mm_max_pd(hi, x);
+  }
+  if (_mm_movemask_pd(nan)) {
+    *min = *max = __builtin_nan("");
+    return;
+  }
+  double los[3], his[3], unused;
+  _mm_storeu_pd(los, lo);
+  _mm_storeu_pd(his, hi);
+  los[2] = his[2] = a[0];
+  if (i < n) minmax_f64(a+i, n-i, &los[2], &his[2]);
+  minmax_f64(los, 3, min, &unused);
+  minmax_f64(his, 3, &unused, max);
+}
+SSE2 static int add_s32_sse2(int32_t *r, const int32_t *a, const int32_t *b,
+                             uint32_t n) {
+  /* a sum overflowed if its sign differs from both addends' */
+  __m128i over = _mm_setzero_si128();
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+    __m128i sum = _mm_add_epi32(x, y);
+    over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(x, sum),
+                                            _mm_xor_si128(y, sum)));
+    _mm_storeu_si128((__m128i *)(r+i), sum);
+  }
+  if (_mm_movemask_ps(_mm_castsi128_ps(over))) return 0;
+  return add_s32(r+i, a+i, b+i, n-i);
+}
+SSE2 static void add_f64_sse2(double *r, const double *a, const double *b,
+                              uint32_t n) {
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2)
+    _mm_storeu_pd(r+i, _mm_add_pd(_mm_loadu_pd(a+i), _mm_loadu_pd(b+i)));
+  add_f64(r+i, a+i, b+i, n-i);
+}
+SSE2 static void scale_f64_sse2(double *r, const double *a, uint32_t n,
+                                double k) {
+  __m128d v = _mm_set1_pd(k);
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2) _mm_storeu_pd(r+i, _mm_mul_pd(_mm_loadu_pd(a+i), v));
+  scale_f64(r+i, a+i, n-i, k);
+}
+SSE2 static double dot_f64_sse2(const double *a, const double *b,
+                                uint32_t n) {
+  __m128d sum = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i+2 <= n; i += 2)
+    sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a+i), _mm_loadu_pd(b+i)));
+  double lanes[2];
+  _mm_storeu_pd(lanes, sum);
+  return lanes[0] + lanes[1] + dot_f64(a+i, b+i, n-i);
+}
+
+static const struct kernels sse2_kernels = {
+  "sse2", fill_s32_sse2, fill_f64_sse2, sum_s32_sse2, sum_f64_sse2,
+  minmax_s32_sse2, minmax_f64_sse2, add_s32_sse2, add_f64_sse2,
+  scale_s32, scale_f64_sse2, dot_f64_sse2
+};
+
+/* AVX2: twice as wide, with 32-bit multiply, min and max. */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void fill_s32_avx2(int32_t *d, uint32_t n, int32_t x) {
+  __m256i v = _mm256_set1_epi32(x);
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) _mm256_storeu_si256((__m256i *)(d+i), v);
+  fill_s32(d+i, n-i, x);
+}
+AVX2 static void fill_f64_avx2(double *d, uint32_t n, double x) {
+  __m256d v = _mm256_set1_pd(x);
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) _mm256_storeu_pd(d+i, v);
+  fill_f64(d+i, n-i, x);
+}
+AVX2 static int64_t sum_s32_avx2(const int32_t *a, uint32_t n) {
+  __m256i sum = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+    sum = _mm256_add_epi64(sum,
+            _mm256_cvtepi32_epi64(_mm256_castsi256_si128(x)));
+    sum = _mm256_add_epi64(sum,
+            _mm256_cvtepi32_epi64(_mm256_extracti128_si256(x, 1)));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_s32(a+i, n-i);
+}
+AVX2 static double sum_f64_avx2(const double *a, uint32_t n) {
+  __m256d sum = _mm256_setzero_pd();
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) sum = _mm256_add_pd(sum, _mm256_loadu_pd(a+i));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, sum);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_f64(a+i, n-i);
+}
+AVX2 static void minmax_s32_avx2(const int32_t *a, uint32_t n, int32_t *min,
+                                 int32_t *max) {
+  __m256i lo = _mm256_set1_epi32(a[0]), hi = lo;
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+    lo = _mm256_min_epi32(lo, x);
+    hi = _mm256_max_epi32(hi, x);
+  }
+  int32_t los[9], his[9], unused;
+  _mm256_storeu_si256((__m256i *)los, lo);
+  _mm256_storeu_si256((__m256i *)his, hi);
+  los[8] = his[8] = a[0];
+  if (i < n) minmax_s32(a+i, n-i, &los[8], &his[8]);
+  minmax_s32(los, 9, min, &unused);
+  minmax_s32(his, 9, &unused, max);
+}
+AVX2 static void minmax_f64_avx2(const double *a, uint32_t n, double *min,
+                                 double *max) {
+  __m256d lo = _mm256_set1_pd(a[0]), hi = lo, nan = _mm256_setzero_pd();
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a+i);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    lo = _mm256_min_pd(lo, x);
+    hi = _mm256_max_pd(hi, x);
+  }
+  if (_mm256_movemask_pd(nan)) {
+    *min = *max = __builtin_nan("");
+    return;
+  }
+  double los[5], his[5], unused;
+  _mm256_storeu_pd(los, lo);
+  _mm256_storeu_pd(his, hi);
+  los[4] = his[4] = a[0];
+  if (i < n) minmax_f64(a+i, n-i, &los[4], &his[4]);
+  minmax_f64(los, 5, min, &unused);
+  minmax_f64(his, 5, &unused, max);
+}
+AVX2 static int add_s32_avx2(int32_t *r, const int32_t *a, const int32_t *b,
+                             uint32_t n) {
+  __m256i over = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+    __m256i sum = _mm256_add_epi32(x, y);
+    over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(x, sum),
+                                                  _mm256_xor_si256(y, sum)));
+    _mm256_storeu_si256((__m256i *)(r+i), sum);
+  }
+  if (_mm256_movemask_ps(_mm256_castsi256_ps(over))) return 0;
+  return add_s32(r+i, a+i, b+i, n-i);
+}
+AVX2 static void add_f64_avx2(double *r, const double *a, const double *b,
+                              uint32_t n) {
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4)
+    _mm256_storeu_pd(r+i, _mm256_add_pd(_mm256_loadu_pd(a+i),
+                                        _mm256_loadu_pd(b+i)));
+  add_f64(r+i, a+i, b+i, n-i);
+}
+AVX2 static void scale_s32_avx2(int32_t *r, const int32_t *a, uint32_t n,
+                                int32_t k) {
+  __m256i v = _mm256_set1_epi32(k);
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i *)(r+i), _mm256_mullo_epi32(
+      _mm256_loadu_si256((const __m256i *)(a+i)), v));
+  scale_s32(r+i, a+i, n-i, k);
+}
+AVX2 static void scale_f64_avx2(double *r, const double *a, uint32_t n,
+                                double k) {
+  __m256d v = _mm256_set1_pd(k);
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4)
+    _mm256_storeu_pd(r+i, _mm256_mul_pd(_mm256_loadu_pd(a+i), v));
+  scale_f64(r+i, a+i, n-i, k);
+}
+AVX2 static double dot_f64_avx2(const double *a, const double *b,
+                                uint32_t n) {
+  __m256d sum = _mm256_setzero_pd();
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4)
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(a+i),
+                                           _mm256_loadu_pd(b+i)));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, sum);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         dot_f64(a+i, b+i, n-i);
+}
+
+static const struct kernels avx2_kernels = {
+  "avx2", fill_s32_avx2, fill_f64_avx2, sum_s32_avx2, sum_f64_avx2,
+  minmax_s32_avx2, minmax_f64_avx2, add_s32_avx2, add_f64_avx2,
+  scale_s32_avx2, scale_f64_avx2, dot_f64_avx2
+};
+#endif
+
+static const struct kernels *kernels = &scalar_kernels;
+
+/* the best the processor can do is picked unless --simd says lower */
+static const char *simd_limit = 0;
+
+int set_simd(const char *name) {
+  if (strcmp(name, "avx2") != 0 && strcmp(name, "sse2") != 0 &&
+      strcmp(name, "scalar") != 0)
+    return 0;
+  simd_limit = name;
+  return 1;
+}
+
+const char *simd_name(void) {
+  return kernels->name;
+}
+
+static void pick_kernels(void) {
+  kernels = &scalar_kernels;
+#if X86
+  int below_avx2 = simd_limit && strcmp(simd_limit, "avx2") != 0;
+  int below_sse2 = simd_limit && strcmp(simd_limit, "scalar") == 0;
+  __builtin_cpu_init();
+  if (!below_avx2 && __builtin_cpu_supports("avx2")) kernels = &avx2_kernels;
+  else if (!below_sse2 && __builtin_cpu_supports("sse2"))
+    kernels = &sse2_kernels;
+#endif
+}
+
+/* Storage. */
+
+static const uint32_t elem_sizes[] = {
+  [NVEC_S32] = sizeof(int32_t), [NVEC_F64] = sizeof(double),
+  [NVEC_U8] = sizeof(uint8_t)
+};
+
+/* the cells a numeric vector takes, header and padding included */
+uint32_t nvector_cells(uint32_t kind, uint32_t len) {
+  return CELLS_EVEN(1 + ((uint64_t)len*elem_sizes[kind] + 7)/8);
+}
+
+/* with its elements zeroed */
+static uint32_t make_nvector(uint32_t kind, uint32_t len) {
+  uint32_t size = nvector_cells(kind, len);
+  CHECK_CELLS(size);
+  STAT(stats.cells[T_NVEC] += size);
+  if (alloc_profiling) profile_alloc(ALLOC_VECTOR, size);
+  uint32_t index = next_cell;
+  cells[index] = T_NVEC | (uint64_t)kind << 8 | (uint64_t)len << 32;
+  memset(cells+index+1, 0, (size-1)*sizeof(uint64_t));
+  next_cell += size;
+  return index;
+}
+
+#define S32_START(i) ((int32_t *)NVEC_START(i))
+#define F64_START(i) ((double *)NVEC_START(i))
+#define U8_START(i) ((uint8_t *)NVEC_START(i))
+
+/* What a value is as an element of a kind of vector; 0 if it can't be
+   one. f64vectors take any real number, the others exact integers in
+   their range. */
+static int to_element(uint32_t kind, uint32_t val, int32_t *n, double *x) {
+  switch (kind) {
+    case NVEC_S32:
+      if (TYPE(val) != T_INT32) return 0;
+      *n = INT32_VALUE(val);
+      return 1;
+    case NVEC_U8:
+      if (TYPE(val) != T_INT32) return 0;
+      *n = INT32_VALUE(val);
+      return *n >= 0 && *n <= 255;
+    default:
+      if (TYPE(val) == T_FLO) *x = FLO_VALUE(val);
+      else if (TYPE(val) == T_INT32) *x = INT32_VALUE(val);
+      else if (TYPE(val) == T_BIG) *x = bignum_to_double(val);
+      else return 0;
+      return 1;
+  }
+}
+
+static void set_element(uint32_t vec, uint32_t k, int32_t n, double x) {
+  switch (NVEC_KIND(vec)) {
+    case NVEC_S32: S32_START(vec)[k] = n; break;
+    case NVEC_U8: U8_START(vec)[k] = (uint8_t)n; break;
+    default: F64_START(vec)[k] = x; break;
+  }
+}
+
+/* may allocate */
+static uint32_t get_element(uint32_t vec, uint32_t k) {
+  switch (NVEC_KIND(vec)) {
+    case NVEC_S32: return store_int32(S32_START(vec)[k]);
+    case NVEC_U8: return MAKE_FIXNUM(U8_START(vec)[k]);
+    default: return store_flonum(F64_START(vec)[k]);
+  }
+}
+
+void print_nvector(uint32_t index) {
+  static const char *prefixes[] = {
+    [NVEC_S32] = "#s32(", [NVEC_F64] = "#f64(", [NVEC_U8] = "#u8("
+  };
+  uint32_t len = NVEC_LEN(index);
+  printf("%s", prefixes[NVEC_KIND(index)]);
+  for (uint32_t i = 0; i < len; i++) {
+    if (i > 0) putchar(' ');
+    switch (NVEC_KIND(index)) {
+      case NVEC_S32: printf("%d", S32_START(index)[i]); break;
+      case NVEC_U8: printf("%u", U8_START(index)[i]); break;
+      default: print_flonum(F64_START(index)[i]); break;
+    }
+  }
+  putchar(')');
+}
+
+/* for equal?: bit for bit, as eqv? compares flonums */
+int nvector_equal(uint32_t a, uint32_t b) {
+  if (NVEC_KIND(a) != NVEC_KIND(b) || NVEC_LEN(a) != NVEC_LEN(b)) return 0;
+  return memcmp(NVEC_START(a), NVEC_START(b),
+                (size_t)NVEC_LEN(a)*elem_sizes[NVEC_KIND(a)]) == 0;
+}
+
+/* Builtins. Most of them are the same for every kind, and get made for
+   each by the macros at the end. */
+
+#define IS_NVEC(i, kind) (TYPE(i) == T_NVEC && NVEC_KIND(i) == (kind))
+
+static uint32_t nvec_make(uint32_t kind, const uint32_t *args,
+                          uint32_t nargs) {
+  int32_t n = 0;
+  double x = 0;
+  if (TYPE(args[0]) != T_INT32 || INT32_VALUE(args[0]) < 0) return 0;
+  if (nargs > 1 && !to_element(kind, args[1], &n, &x)) return 0;
+  uint32_t len = INT32_VALUE(args[0]);
+  uint32_t vec = make_nvector(kind, len);
+  if (nargs > 1) {
+    switch (kind) {
+      case NVEC_S32: kernels->fill_s32(S32_START(vec), len, n); break;
+      case NVEC_U8: memset(U8_START(vec), n, len); break;
+      default: kernels->fill_f64(F64_START(vec), len, x); break;
+    }
+  }
+  return vec;
+}
+
+static uint32_t nvec_from_args(uint32_t kind, const uint32_t *args,
+                               uint32_t nargs) {
+  int32_t n = 0;
+  double x = 0;
+  for (uint32_t i = 0; i < nargs; i++)
+    if (!to_element(kind, args[i], &n, &x)) return 0;
+  uint32_t vec = make_nvector(kind, nargs);
+  for (uint32_t i = 0; i < nargs; i++) {
+    to_element(kind, args[i], &n, &x);
+    set_element(vec, i, n, x);
+  }
+  return vec;
+}
+
+static uint32_t nvec_p(uint32_t kind, const uint32_t *args, uint32_t nargs) {
+  return IS_NVEC(args[0], kind) ? C_TRUE : C_FALSE;
+}
+
+static uint32_t nvec_length(uint32_t kind, const uint32_t *args,
+                            uint32_t nargs) {
+  if (!IS_NVEC(args[0], kind)) return 0;
+  return store_int32(NVEC_LEN(args[0]));
+}
+
+/* 0 if k isn't an index into vec, or one past the end with end set */
+static int nvec_index(uint32_t vec, uint32_t k, int end, uint32_t *index) {
+  if (TYPE(k) != T_INT32 || INT32_VALUE(k) < 0 ||
+      (uint64_t)INT32_VALUE(k) + !end > NVEC_LEN(vec))
+    return 0;
+  *index = INT32_VALUE(k);
+  return 1;
+}
+
+static uint32_t nvec_ref(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  uint32_t k;
+  if (!IS_NVEC(args[0], kind) || !nvec_index(args[0], args[1], 0, &k))
+    return 0;
+  return get_element(args[0], k);
+}
+
+static uint32_t nvec_set(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  uint32_t k;
+  int32_t n = 0;
+  double x = 0;
+  if (!IS_NVEC(args[0], kind) || !nvec_index(args[0], args[1], 0, &k) ||
+      !to_element(kind, args[2], &n, &x))
+    return 0;
+  set_element(args[0], k, n, x);
+  return C_UNSPEC;
+}
+
+static uint32_t nvec_fill(uint32_t kind, const uint32_t *args,
+                          uint32_t nargs) {
+  uint32_t vec = args[0];
+  int32_t n = 0;
+  double x = 0;
+  if (!IS_NVEC(vec, kind) || !to_element(kind, args[1], &n, &x)) return 0;
+  switch (kind) {
+    case NVEC_S32: kernels->fill_s32(S32_START(vec), NVEC_LEN(vec), n); break;
+    case NVEC_U8: memset(U8_START(vec), n, NVEC_LEN(vec)); break;
+    default: kernels->fill_f64(F64_START(vec), NVEC_LEN(vec), x); break;
+  }
+  return C_UNSPEC;
+}
+
+/* (X-copy! to at from): all of from into to, starting at at */
+static uint32_t nvec_copy(uint32_t kind, const uint32_t *args,
+                          uint32_t nargs) {
+  uint32_t to = args[0], from = args[2], at;
+  if (!IS_NVEC(to, kind) || !IS_NVEC(from, kind) ||
+      !nvec_index(to, args[1], 1, &at) ||
+      NVEC_LEN(from) > NVEC_LEN(to) - at)
+    return 0;
+  size_t size = elem_sizes[kind];
+  memmove((char *)NVEC_START(to) + at*size, NVEC_START(from),
+          NVEC_LEN(from)*size);
+  return C_UNSPEC;
+}
+
+static uint32_t nvec_sum(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  uint32_t vec = args[0];
+  if (!IS_NVEC(vec, kind)) return 0;
+  if (kind == NVEC_S32)
+    return store_int64(kernels->sum_s32(S32_START(vec), NVEC_LEN(vec)));
+  return store_flonum(kernels->sum_f64(F64_START(vec), NVEC_LEN(vec)));
+}
+
+static uint32_t nvec_minmax(uint32_t kind, const uint32_t *args, int max) {
+  uint32_t vec = args[0];
+  if (!IS_NVEC(vec, kind) || NVEC_LEN(vec) == 0) return 0;
+  if (kind == NVEC_S32) {
+    int32_t lo, hi;
+    kernels->minmax_s32(S32_START(vec), NVEC_LEN(vec), &lo, &hi);
+    return store_int32(max ? hi : lo);
+  }
+  double lo, hi;
+  kernels->minmax_f64(F64_START(vec), NVEC_LEN(vec), &lo, &hi);
+  return store_flonum(max ? hi : lo);
+}
+
+static uint32_t nvec_min(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  return nvec_minmax(kind, args, 0);
+}
+
+static uint32_t nvec_max(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  return nvec_minmax(kind, args, 1);
+}
+
+/* elementwise sum, in a new vector: an s32 one only if every sum fits */
+static uint32_t nvec_add(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  if (!IS_NVEC(args[0], kind) || !IS_NVEC(args[1], kind) ||
+      NVEC_LEN(args[0]) != NVEC_LEN(args[1]))
+    return 0;
+  uint32_t len = NVEC_LEN(args[0]);
+  uint32_t res = make_nvector(kind, len);  /* args are reread after this */
+  if (kind == NVEC_S32)
+    return kernels->add_s32(S32_START(res), S32_START(args[0]),
+                            S32_START(args[1]), len) ? res : 0;
+  kernels->add_f64(F64_START(res), F64_START(args[0]), F64_START(args[1]),
+                   len);
+  return res;
+}
+
+/* every element times a number, in a new vector */
+static uint32_t nvec_scale(uint32_t kind, const uint32_t *args,
+                           uint32_t nargs) {
+  int32_t k = 0;
+  double x = 0;
+  if (!IS_NVEC(args[0], kind) || !to_element(kind, args[1], &k, &x))
+    return 0;
+  uint32_t len = NVEC_LEN(args[0]);
+  if (kind == NVEC_S32 && len > 0) {
+    /* the products are in range if the extreme ones are */
+    int32_t lo, hi, product;
+    kernels->minmax_s32(S32_START(args[0]), len, &lo, &hi);
+    if (__builtin_mul_overflow(lo, k, &product) ||
+        __builtin_mul_overflow(hi, k, &product))
+      return 0;
+  }
+  uint32_t res = make_nvector(kind, len);
+  if (kind == NVEC_S32)
+    kernels->scale_s32(S32_START(res), S32_START(args[0]), len, k);
+  else
+    kernels->scale_f64(F64_START(res), F64_START(args[0]), len, x);
+  return res;
+}
+
+static uint32_t nvec_dot(uint32_t kind, const uint32_t *args,
+                         uint32_t nargs) {
+  if (!IS_NVEC(args[0], kind) || !IS_NVEC(args[1], kind) ||
+      NVEC_LEN(args[0]) != NVEC_LEN(args[1]))
+    return 0;
+  return store_flonum(kernels->dot_f64(F64_START(args[0]),
+                                       F64_START(args[1]),
+                                       NVEC_LEN(args[0])));
+}
+
+#define GEN_NVEC_BUILTIN(func_name, kind, op) \
+  static uint32_t func_name(const uint32_t *args, uint32_t nargs) { \
+    return op(kind, args, nargs); \
+  }
+
+#define GEN_NVEC_BUILTINS(prefix, kind) \
+  GEN_NVEC_BUILTIN(prefix##_make, kind, nvec_make) \
+  GEN_NVEC_BUILTIN(prefix##_from_args, kind, nvec_from_args) \
+  GEN_NVEC_BUILTIN(prefix##_p, kind, nvec_p) \
+  GEN_NVEC_BUILTIN(prefix##_length, kind, nvec_length) \
+  GEN_NVEC_BUILTIN(prefix##_ref, kind, nvec_ref) \
+  GEN_NVEC_BUILTIN(prefix##_set, kind, nvec_set) \
+  GEN_NVEC_BUILTIN(prefix##_fill, kind, nvec_fill) \
+  GEN_NVEC_BUILTIN(prefix##_copy, kind, nvec_copy)
+
+#define GEN_NVEC_ARITH(prefix, kind) \
+  GEN_NVEC_BUILTIN(prefix##_sum, kind, nvec_sum) \
+  GEN_NVEC_BUILTIN(prefix##_min, kind, nvec_min) \
+  GEN_NVEC_BUILTIN(prefix##_max, kind, nvec_max) \
+  GEN_NVEC_BUILTIN(prefix##_add, kind, nvec_add) \
+  GEN_NVEC_BUILTIN(prefix##_scale, kind, nvec_scale)
+
+GEN_NVEC_BUILTINS(s32, NVEC_S32)
+GEN_NVEC_ARITH(s32, NVEC_S32)
+GEN_NVEC_BUILTINS(f64, NVEC_F64)
+GEN_NVEC_ARITH(f64, NVEC_F64)
+GEN_NVEC_BUILTIN(f64_dot, NVEC_F64, nvec_dot)
+GEN_NVEC_BUILTINS(u8, NVEC_U8)
+
+void register_nvector_builtins(void) {
+  pick_kernels();
+
+  register_builtin("make-s32vector", s32_make, 1, 2);
+  register_builtin("s32vector", s32_from_args, 0, ANY_ARGS);
+  register_builtin("s32vector?", s32_p, 1, 1);
+  register_builtin("s32vector-length", s32_length, 1, 1);
+  register_builtin("s32vector-ref", s32_ref, 2, 2);
+  register_builtin("s32vector-set!", s32_set, 3, 3);
+  register_builtin("s32vector-fill!", s32_fill, 2, 2);
+  register_builtin("s32vector-copy!", s32_copy, 3, 3);
+  register_builtin("s32vector-sum", s32_sum, 1, 1);
+  register_builtin("s32vector-min", s32_min, 1, 1);
+  register_builtin("s32vector-max", s32_max, 1, 1);
+  register_builtin("s32vector-add", s32_add, 2, 2);
+  register_builtin("s32vector-scale", s32_scale, 2, 2);
+
+  register_builtin("make-f64vector", f64_make, 1, 2);
+  register_builtin("f64vector", f64_from_args, 0, ANY_ARGS);
+  register_builtin("f64vector?", f64_p, 1, 1);
+  register_builtin("f64vector-length", f64_length, 1, 1);
+  register_builtin("f64vector-ref", f64_ref, 2, 2);
+  register_builtin("f64vector-set!", f64_set, 3, 3);
+  register_builtin("f64vector-fill!", f64_fill, 2, 2);
+  register_builtin("f64vector-copy!", f64_copy, 3, 3);
+  register_builtin("f64vector-sum", f64_sum, 1, 1);
+  register_builtin("f64vector-min", f64_min, 1, 1);
+  register_builtin("f64vector-max", f64_max, 1, 1);
+  register_builtin("f64vector-add", f64_add, 2, 2);
+  register_builtin("f64vector-scale", f64_scale, 2, 2);
+  register_builtin("f64vector-dot", f64_dot, 2, 2);
+
+  register_builtin("make-bytevector", u8_make, 1, 2);
+  register_builtin("bytevector", u8_from_args, 0, ANY_ARGS);
+  register_builtin("bytevector?", u8_p, 1, 1);
+  register_builtin("bytevector-length", u8_length, 1, 1);
+  register_builtin("bytevector-u8-ref", u8_ref, 2, 2);
+  register_builtin("bytevector-u8-set!", u8_set, 3, 3);
+  register_builtin("bytevector-fill!", u8_fill, 2, 2);
+  register_builtin("bytevector-copy!", u8_copy, 3, 3);
+}
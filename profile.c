@@ -0,0 +1,436 @@
+#define _POSIX_C_SOURCE 200809L  /* for sigaction(), setitimer() */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+/* The profiler. A SIGPROF timer ticks while sketch runs, and the
+   handler only counts the tick. The evaluators keep a shadow stack of
+   the lambdas they're in, and when they next call a lambda or a
+   builtin, they see the count and record the stack as it is: one sample
+   per tick. So time goes to the stack that makes the next call, which
+   is close enough.
+
+   Lambdas are known by their body, which moves when the collector
+   runs; bodies on the shadow stack and in the list of sites are roots,
+   and the collector keeps them up to date. A site is named after the
+   define it's the value of, or the lambda it's in (see
+   profile_site_name()).
+
+   The allocation profiler uses the same shadow stack: it charges each
+   allocation to the lambda that's running and the builtin it called,
+   if any. */
+
+int profiling = 0, alloc_profiling = 0;
+static int timing = 0;
+
+/* ticks per second */
+#define PROFILE_HZ 1000
+
+/* the innermost frames kept in a sample */
+#define MAX_SAMPLE_DEPTH 256
+/* in place of the frames left out */
+#define TRUNCATED 0xFFFFFFFF
+
+static volatile sig_atomic_t ticks = 0;
+
+static void on_tick(int sig) {
+  ticks++;
+}
+
+/* Sites. */
+
+struct site {
+  uint32_t body;
+  const char *name;
+  uint64_t self, total;  /* samples it's the innermost in, and in at all */
+  uint64_t stamp;        /* the last sample counted in total */
+};
+static struct site *sites = 0;
+static uint32_t num_sites = 0, max_sites = 0;
+
+/* body -> position in sites[] + 1, rebuilt when bodies may have moved */
+static uint32_t *site_index = 0;
+static uint32_t site_index_size = 0;
+static uint64_t site_index_gc = 0;
+static int site_index_valid = 0;
+
+const char *profile_site_name(uint32_t sym, const char *outer) {
+  char *name;
+  if (sym) {
+    name = malloc(STR_LEN(sym)+1);
+    if (name == 0) die("couldn't alloc memory for the profiler");
+    memcpy(name, STR_START(sym), STR_LEN(sym));
+    name[STR_LEN(sym)] = '\0';
+  } else {
+    if (outer == 0) return "lambda";
+    name = malloc(strlen(outer) + sizeof("/lambda"));
+    if (name == 0) die("couldn't alloc memory for the profiler");
+    strcpy(name, outer);
+    strcat(name, "/lambda");
+  }
+  return name;
+}
+
+void profile_add_site(uint32_t body, const char *name) {
+  if (num_sites == max_sites) {
+    max_sites = max_sites ? max_sites*2 : 256;
+    sites = realloc(sites, max_sites*sizeof(struct site));
+    if (sites == 0) die("couldn't alloc memory for the profiler");
+  }
+  memset(&sites[num_sites], 0, sizeof(struct site));
+  sites[num_sites].body = body;
+  sites[num_sites++].name = name;
+  site_index_valid = 0;
+}
+
+#define HASH_INDEX(i) ((i) * 2654435761u)
+
+static void index_sites(void) {
+  site_index_size = 1024;
+  while (site_index_size < num_sites*2) site_index_size *= 2;
+  free(site_index);
+  site_index = calloc(site_index_size, sizeof(uint32_t));
+  if (site_index == 0) die("couldn't alloc memory for the profiler");
+  for (uint32_t i = 0; i < num_sites; i++) {
+    uint32_t pos = HASH_INDEX(sites[i].body) & (site_index_size-1);
+    while (site_index[pos]) pos = (pos+1) & (site_index_size-1);
+    site_index[pos] = i+1;
+  }
+  site_index_gc = gc_count;
+  site_index_valid = 1;
+}
+
+static struct site *find_site(uint32_t body) {
+  if (!site_index_valid || site_index_gc != gc_count) index_sites();
+  uint32_t pos = HASH_INDEX(body) & (site_index_size-1);
+  while (site_index[pos]) {
+    if (sites[site_index[pos]-1].body == body) return &sites[site_index[pos]-1];
+    pos = (pos+1) & (site_index_size-1);
+  }
+  return 0;
+}
+
+/* The shadow stack: the body of each lambda being run, innermost
+   last. */
+
+static uint32_t *profile_stack = 0;
+uint32_t profile_top = 0;
+static uint32_t profile_max = 0;
+
+uint32_t profile_builtin_id = 0;  /* the builtin being called + 1, or 0 */
+
+static void visit_profile(void (*visit)(uint32_t *)) {
+  for (uint32_t i = 0; i < profile_top; i++) visit(&profile_stack[i]);
+  for (uint32_t i = 0; i < num_sites; i++) visit(&sites[i].body);
+}
+
+/* Samples, as collapsed stacks: each distinct stack of sites, outermost
+   first, with the number of samples that saw it. */
+
+struct stack {
+  uint32_t hash, start, len;  /* the sites, in stack_sites[] */
+  uint64_t count;
+};
+static struct stack *stacks = 0;  /* open-addressed by hash */
+static uint32_t num_stacks = 0, max_stacks = 0;
+static uint32_t *stack_sites = 0;  /* site + 1, or 0 for an unknown one */
+static uint32_t stack_sites_size = 0, stack_sites_max = 0;
+static uint64_t num_samples = 0;
+
+static void grow_stacks(void) {
+  struct stack *old = stacks;
+  uint32_t old_max = max_stacks;
+  max_stacks = max_stacks ? max_stacks*2 : 1024;
+  stacks = calloc(max_stacks, sizeof(struct stack));
+  if (stacks == 0) die("couldn't alloc memory for the profiler");
+  for (uint32_t i = 0; i < old_max; i++) {
+    if (old[i].count == 0) continue;
+    uint32_t pos = old[i].hash & (max_stacks-1);
+    while (stacks[pos].count) pos = (pos+1) & (max_stacks-1);
+    stacks[pos] = old[i];
+  }
+  free(old);
+}
+
+static void take_sample(void) {
+  uint32_t ids[MAX_SAMPLE_DEPTH+1];
+  uint32_t first = 0, len = 0, hash = 2166136261u;
+  num_samples++;
+  if (profile_top > MAX_SAMPLE_DEPTH) {
+    first = profile_top - MAX_SAMPLE_DEPTH;
+    ids[len++] = TRUNCATED;
+  }
+  for (uint32_t i = first; i < profile_top; i++, len++) {
+    struct site *site = find_site(profile_stack[i]);
+    ids[len] = site ? site - sites + 1 : 0;
+    hash = (hash ^ ids[len]) * 16777619u;
+    if (site && site->stamp != num_samples) {
+      site->total++;
+      site->stamp = num_samples;
+    }
+  }
+  if (profile_top > 0 && ids[len-1]) sites[ids[len-1]-1].self++;
+
+  if ((num_stacks+1)*2 > max_stacks) grow_stacks();
+  uint32_t pos = hash & (max_stacks-1);
+  while (stacks[pos].count) {
+    struct stack *s = &stacks[pos];
+    if (s->hash == hash && s->len == len &&
+        memcmp(stack_sites + s->start, ids, len*sizeof(uint32_t)) == 0) {
+      s->count++;
+      return;
+    }
+    pos = (pos+1) & (max_stacks-1);
+  }
+  if (stack_sites_size + len > stack_sites_max) {
+    stack_sites_max = (stack_sites_size + len) * 2;
+    stack_sites = realloc(stack_sites, stack_sites_max*sizeof(uint32_t));
+    if (stack_sites == 0) die("couldn't alloc memory for the profiler");
+  }
+  memcpy(stack_sites + stack_sites_size, ids, len*sizeof(uint32_t));
+  stacks[pos].hash = hash;
+  stacks[pos].start = stack_sites_size;
+  stacks[pos].len = len;
+  stacks[pos].count = 1;
+  stack_sites_size += len;
+  num_stacks++;
+}
+
+/* Called by the evaluators before calling a builtin, and on entering a
+   lambda body: the second one replaces the lambda that's tail calling.
+   Each takes the samples for the ticks that came. */
+void profile_builtin(uint32_t id) {
+  while (ticks > 0) { ticks--; take_sample(); }
+  profile_builtin_id = id + 1;
+}
+
+void profile_call(uint32_t body) {
+  while (ticks > 0) { ticks--; take_sample(); }
+  profile_builtin_id = 0;
+  if (profile_top == profile_max) {
+    profile_max = profile_max ? profile_max*2 : 1024;
+    profile_stack = realloc(profile_stack, profile_max*sizeof(uint32_t));
+    if (profile_stack == 0) die("couldn't alloc memory for the profiler");
+  }
+  profile_stack[profile_top++] = body;
+}
+
+void profile_tail_call(uint32_t body) {
+  while (ticks > 0) { ticks--; take_sample(); }
+  profile_builtin_id = 0;
+  profile_stack[profile_top-1] = body;
+}
+
+/* Allocations, by kind and by site: the lambda running (or none) and
+   the builtin it called (or none). */
+
+static const char *alloc_kinds[] = {
+  [ALLOC_PAIR] = "pair", [ALLOC_VECTOR] = "vector",
+  [ALLOC_ENV] = "environment", [ALLOC_INTEGER] = "integer",
+  [ALLOC_STRING] = "string", [ALLOC_SYMBOL] = "symbol",
+  [ALLOC_CLOSURE] = "closure", [ALLOC_CODE] = "code",
+  [ALLOC_FLONUM] = "flonum",
+};
+#define NUM_ALLOC_KINDS (sizeof(alloc_kinds)/sizeof(alloc_kinds[0]))
+
+struct alloc_count {
+  uint64_t objects, cells;
+};
+static struct alloc_count by_kind[NUM_ALLOC_KINDS];
+
+struct alloc_site {
+  uint32_t site, builtin;  /* site + 1 and builtin + 1, or 0 for none */
+  struct alloc_count count;
+};
+static struct alloc_site *alloc_sites = 0;  /* open-addressed */
+static uint32_t num_alloc_sites = 0, max_alloc_sites = 0;
+
+#define HASH_ALLOC_SITE(s, b) HASH_INDEX((s) * (MAX_BUILTINS+1) + (b))
+
+static void grow_alloc_sites(void) {
+  struct alloc_site *old = alloc_sites;
+  uint32_t old_max = max_alloc_sites;
+  max_alloc_sites = max_alloc_sites ? max_alloc_sites*2 : 1024;
+  alloc_sites = calloc(max_alloc_sites, sizeof(struct alloc_site));
+  if (alloc_sites == 0) die("couldn't alloc memory for the profiler");
+  for (uint32_t i = 0; i < old_max; i++) {
+    if (old[i].count.objects == 0) continue;
+    uint32_t pos = HASH_ALLOC_SITE(old[i].site, old[i].builtin)
+                   & (max_alloc_sites-1);
+    while (alloc_sites[pos].count.objects) pos = (pos+1) & (max_alloc_sites-1);
+    alloc_sites[pos] = old[i];
+  }
+  free(old);
+}
+
+void profile_alloc(int kind, uint32_t cells) {
+  by_kind[kind].objects++;
+  by_kind[kind].cells += cells;
+
+  uint32_t site = 0;
+  if (profile_top > 0) {
+    struct site *s = find_site(profile_stack[profile_top-1]);
+    if (s) site = s - sites + 1;
+  }
+  if ((num_alloc_sites+1)*2 > max_alloc_sites) grow_alloc_sites();
+  uint32_t pos = HASH_ALLOC_SITE(site, profile_builtin_id)
+                 & (max_alloc_sites-1);
+  while (alloc_sites[pos].count.objects) {
+    struct alloc_site *a = &alloc_sites[pos];
+    if (a->site == site && a->builtin == profile_builtin_id) break;
+    pos = (pos+1) & (max_alloc_sites-1);
+  }
+  struct alloc_site *a = &alloc_sites[pos];
+  if (a->count.objects == 0) {
+    a->site = site;
+    a->builtin = profile_builtin_id;
+    num_alloc_sites++;
+  }
+  a->count.objects++;
+  a->count.cells += cells;
+}
+
+/* Reports. */
+
+static const char *site_name(uint32_t id) {
+  if (id == TRUNCATED) return "...";
+  return id ? sites[id-1].name : "?";
+}
+
+static int by_self(const void *a, const void *b) {
+  const struct site *x = *(const struct site **)a, *y = *(const struct site **)b;
+  if (x->self != y->self) return x->self < y->self ? 1 : -1;
+  if (x->total != y->total) return x->total < y->total ? 1 : -1;
+  return 0;
+}
+
+static char *collapsed_path = 0;
+
+static void time_report(void) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, 0);
+
+  /* the flat profile, busiest first */
+  struct site **sorted = malloc((num_sites+1)*sizeof(struct site *));
+  if (sorted == 0) die("couldn't alloc memory for the profiler");
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_sites; i++)
+    if (sites[i].total) sorted[count++] = &sites[i];
+  qsort(sorted, count, sizeof(struct site *), by_self);
+  fprintf(stderr, "%llu samples\n%7s %7s  %s\n",
+          (unsigned long long)num_samples, "self", "total", "lambda");
+  for (uint32_t i = 0; i < count; i++) {
+    fprintf(stderr, "%6.1f%% %6.1f%%  %s\n",
+            100.0 * sorted[i]->self / num_samples,
+            100.0 * sorted[i]->total / num_samples, sorted[i]->name);
+  }
+  free(sorted);
+
+  /* collapsed stacks, for flamegraph.pl and the like */
+  FILE *out = fopen(collapsed_path, "w");
+  if (out == 0) {
+    fprintf(stderr, "can't write the profile to %s\n", collapsed_path);
+    return;
+  }
+  for (uint32_t i = 0; i < max_stacks; i++) {
+    struct stack *s = &stacks[i];
+    if (s->count == 0) continue;
+    fputs("toplevel", out);
+    for (uint32_t j = 0; j < s->len; j++)
+      fprintf(out, ";%s", site_name(stack_sites[s->start+j]));
+    fprintf(out, " %llu\n", (unsigned long long)s->count);
+  }
+  fclose(out);
+}
+
+static int by_cells(const void *a, const void *b) {
+  const struct alloc_site *x = *(const struct alloc_site **)a;
+  const struct alloc_site *y = *(const struct alloc_site **)b;
+  if (x->count.cells != y->count.cells)
+    return x->count.cells < y->count.cells ? 1 : -1;
+  return 0;
+}
+
+/* the sites that allocate the most */
+#define TOP_ALLOC_SITES 20
+
+static void alloc_report(void) {
+  fprintf(stderr, "allocations by kind:\n%12s %14s  %s\n",
+          "objects", "bytes", "kind");
+  for (uint32_t i = 0; i < NUM_ALLOC_KINDS; i++) {
+    if (by_kind[i].objects == 0) continue;
+    fprintf(stderr, "%12llu %14llu  %s\n",
+            (unsigned long long)by_kind[i].objects,
+            (unsigned long long)(by_kind[i].cells*sizeof(uint64_t)),
+            alloc_kinds[i]);
+  }
+
+  struct alloc_site **sorted = malloc((num_alloc_sites+1)*sizeof(struct alloc_site *));
+  if (sorted == 0) die("couldn't alloc memory for the profiler");
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < max_alloc_sites; i++)
+    if (alloc_sites[i].count.objects) sorted[count++] = &alloc_sites[i];
+  qsort(sorted, count, sizeof(struct alloc_site *), by_cells);
+  fprintf(stderr, "top allocating sites:\n%12s %14s  %s\n",
+          "objects", "bytes", "site");
+  for (uint32_t i = 0; i < count && i < TOP_ALLOC_SITES; i++) {
+    struct alloc_site *a = sorted[i];
+    fprintf(stderr, "%12llu %14llu  %s",
+            (unsigned long long)a->count.objects,
+            (unsigned long long)(a->count.cells*sizeof(uint64_t)),
+            a->site ? sites[a->site-1].name : "toplevel");
+    if (a->builtin) fprintf(stderr, " [%s]", builtin_name(a->builtin-1));
+    fputc('\n', stderr);
+  }
+  free(sorted);
+}
+
+static void profile_report(void) {
+  if (timing) time_report();
+  if (alloc_profiling) alloc_report();
+  profiling = alloc_profiling = timing = 0;
+}
+
+/* Either profiler needs the lambdas named and the shadow stack kept,
+   from before any lambda is prepared. */
+static void profile_enable(void) {
+  if (profiling) return;
+  gc_add_visitor(visit_profile);
+  profiling = 1;
+  atexit(profile_report);
+}
+
+/* Starts counting allocations; the report goes to stderr at exit. */
+void alloc_profile_start(void) {
+  profile_enable();
+  alloc_profiling = 1;
+}
+
+/* Starts profiling; at exit, a flat profile goes to stderr, and
+   collapsed stacks to the file at path. Must come before any lambda
+   is prepared, so that all of them are known. */
+void profile_start(const char *path) {
+  collapsed_path = malloc(strlen(path)+1);
+  if (collapsed_path == 0) die("couldn't alloc memory for the profiler");
+  strcpy(collapsed_path, path);
+  profile_enable();
+  timing = 1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_tick;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGPROF, &action, 0) != 0) die("couldn't set up SIGPROF");
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, 0) != 0) die("couldn't start the profiling timer");
+}
@@ -1,8 +1,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include <math.h>
 
 #include "common.h"
 
@@ -11,30 +11,105 @@ void die(char *msg) {
   exit(1);
 }
 
-uint64_t cells[MAX_CELLS];
-
 /* start after all the special values */
 uint32_t next_cell = C_STARTFROM;
 
 void init_cells(void) {
   cells[C_UNSPEC] = cells[C_EMPTY] = cells[C_FALSE] = cells[C_TRUE] = T_RESV;
+  cells[C_DEFINE] = T_SPECIAL | (uint64_t)F_DEFINE << 32;
+  cells[C_SET] = T_SPECIAL | (uint64_t)F_SET << 32;
+  cells[C_QUOTE] = T_SPECIAL | (uint64_t)F_QUOTE << 32;
+  cells[C_IF] = T_SPECIAL | (uint64_t)F_IF << 32;
+  for (uint32_t form = FIRST_PRIMITIVE;
+       form < FIRST_PRIMITIVE + NUM_PRIMITIVES; form++)
+    cells[C_ADD + 2*(form - F_ADD)] = T_SPECIAL | (uint64_t)form << 32;
+}
+
+/* The global environment. It's not on the heap but a table of its own
+   that grows as globals get defined; a global variable is a T_VAR with
+   GLOBAL_FRAME and its index in here. Undefined ones read as 0. */
+uint32_t *globals = 0;
+static uint32_t max_globals = 0;
+
+void reserve_globals(uint32_t count) {
+  if (count <= max_globals) return;
+  uint32_t size = max_globals ? max_globals : 256;
+  while (size < count) size *= 2;
+  globals = realloc(globals, size*sizeof(uint32_t));
+  if (globals == 0) die("couldn't alloc memory for globals");
+  memset(globals+max_globals, 0, (size-max_globals)*sizeof(uint32_t));
+  max_globals = size;
+}
+
+static void visit_globals(void (*visit)(uint32_t *)) {
+  for (uint32_t i = 0; i < max_globals; i++) visit(&globals[i]);
+}
+
+/* symbols the reader and the evaluator need to recognize */
+uint32_t sym_quote, sym_define, sym_set, sym_if, sym_lambda;
+
+#define INTERN(var, name) do { var = intern_symbol(name, strlen(name)); \
+  } while(0)
+
+/* again after an image replaces the symbol tables */
+void intern_keywords(void) {
+  INTERN(sym_quote, "quote");
+  INTERN(sym_define, "define");
+  INTERN(sym_set, "set!");
+  INTERN(sym_if, "if");
+  INTERN(sym_lambda, "lambda");
+}
+
+void init_symbols(void) {
+  gc_add_global(&sym_quote);
+  gc_add_global(&sym_define);
+  gc_add_global(&sym_set);
+  gc_add_global(&sym_if);
+  gc_add_global(&sym_lambda);
+  intern_keywords();
 }
 
-uint32_t toplevel_env = 0;
+/* The reader classifies characters with a single table lookup each. */
+#define CC_SPACE      1
+#define CC_DIGIT      2
+#define CC_INITIAL    4  /* may start an identifier */
+#define CC_SUBSEQUENT 8  /* may continue one */
+static unsigned char char_class[256];
+
+void init_reader(void) {
+  const char *initial = "!$%&*/:<=>?^_~", *subsequent = "+-.@";
+  for (int c = 'a'; c <= 'z'; c++) char_class[c] = CC_INITIAL | CC_SUBSEQUENT;
+  for (int c = '0'; c <= '9'; c++) char_class[c] = CC_DIGIT | CC_SUBSEQUENT;
+  for (const char *p = initial; *p; p++)
+    char_class[(unsigned char)*p] = CC_INITIAL | CC_SUBSEQUENT;
+  for (const char *p = subsequent; *p; p++)
+    char_class[(unsigned char)*p] = CC_SUBSEQUENT;
+  for (const char *p = " \t\n\v\f\r"; *p; p++)
+    char_class[(unsigned char)*p] = CC_SPACE;
+}
 
-#define SKIP_WS(str) do { while(isspace(*str)) ++str; } while(0)
+#define CHAR_IS(c, class) (char_class[(unsigned char)(c)] & (class))
 
-/* helper rules for identifying symbols */
-#define INITIAL(c) ((c>='a' && c<='z') || c=='!' || c=='$' || c=='%' || \
-                   c=='&' || c=='*' || c=='/' || c==':' || c=='<' || \
-                   c=='=' || c=='>' || c=='?' || c=='^' || c=='_' || c=='~')
+/* skips whitespace and ; comments */
+char *skip_space(char *str) {
+  while(1) {
+    while(CHAR_IS(*str, CC_SPACE)) ++str;
+    if (*str != ';') return str;
+    while(*str && *str != '\n') ++str;
+  }
+}
 
-#define SUBSEQUENT(c) (INITIAL(c) || (c>='0' && c<='9') || c=='+' || \
-                       c=='-' || c=='.' || c=='@')
+#define SKIP_WS(str) do { str = skip_space(str); } while(0)
 
 
 uint32_t make_pair(uint32_t first, uint32_t second) {
-  CHECK_CELLS(2);
+  if (HEAP_FULL(2)) {
+    GC_ROOT(first); GC_ROOT(second);
+    gc_collect(2);
+    GC_UNROOT(2);
+  }
+  STAT(stats.cells[T_PAIR] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_PAIR, 2);
   uint32_t index = next_cell;
   cells[next_cell++] = T_PAIR;
   cells[next_cell++] = ((uint64_t)first << 32) | second;
@@ -42,9 +117,12 @@ uint32_t make_pair(uint32_t first, uint32_t second) {
 }
 
 uint32_t make_list(uint32_t *values, uint32_t count) {
-  /* Adds its own () at the end, no need to pass it. */
+  /* Adds its own () at the end, no need to pass it.
+     values must either be rooted, or the caller must have already
+     made room for the list with CHECK_CELLS(2*count). */
   if (count < 1) die("bad call to make_list");
   uint32_t current = count-1;
+  CHECK_CELLS(2*count);
 
   uint32_t pair = C_EMPTY; /* () at first; then pairs in the loop */
   while(1) {
@@ -55,38 +133,63 @@ uint32_t make_list(uint32_t *values, uint32_t count) {
   return pair;
 }
 
-uint32_t make_vector(uint32_t size, int zero_it) {
+static uint32_t new_vector(uint32_t size, int zero_it, int kind) {
   uint32_t len = (size+1)/2;  /* num of extra cells required */
-  CHECK_CELLS(len+1);
+  CHECK_CELLS(CELLS_EVEN(len+1));
+  STAT(stats.cells[T_VECT] += CELLS_EVEN(len+1));
+  if (alloc_profiling) profile_alloc(kind, CELLS_EVEN(len+1));
   uint32_t index = next_cell;
   uint64_t value = T_VECT | (uint64_t)len << 16 | (uint64_t)(size) << 32;
   cells[next_cell++] = value;
   if (zero_it) memset(VECTOR_START(index), 0, size*sizeof(uint32_t));
-  next_cell += len;
+  next_cell = index + CELLS_EVEN(len+1);
   return index;
 }
+
+uint32_t make_vector(uint32_t size, int zero_it) {
+  return new_vector(size, zero_it, ALLOC_VECTOR);
+}
  
-uint32_t make_env(uint32_t size, uint32_t prev) {
-  uint32_t env = make_vector(size+1, 1);
-  *VECTOR_START(env) = prev;
+uint32_t make_env(uint32_t size) {
+  return new_vector(size, 1, ALLOC_ENV);
+}
+
+/* Like make_env(), but on the frame stack, for a call to a LEAF_MASK
+   lambda; the caller pops it by restoring frame_top once the call is
+   done. Returns 0 if the frame stack is full. Never allocates. */
+uint32_t make_frame_env(uint32_t size) {
+  uint32_t len = (size+1)/2;
+  if ((uint64_t)frame_top + CELLS_EVEN(len+1) > frame_limit) return 0;
+  uint32_t env = frame_top;
+  cells[env] = T_VECT | (uint64_t)len << 16 | (uint64_t)size << 32;
+  memset(VECTOR_START(env), 0, size*sizeof(uint32_t));
+  frame_top += CELLS_EVEN(len+1);
   return env;
 }
 
 void store_env(uint32_t env, uint32_t slot, uint32_t value) {
-  if (slot > VECTOR_LEN(env)) {
-    /* TODO: do something smart for the toplevel environment */
-    die("environment out of range");
-  }
+  if (slot >= VECTOR_LEN(env)) die("environment out of range");
   VECTOR_START(env)[slot] = value;
 }
   
+/* The environment of a lambda call starts with a display: slot k has
+   the environment of the lambda k+1 levels out, and the variables come
+   after it. Toplevel lambdas have none, as globals are elsewhere. The
+   new environment gets its parent from the closure and the rest from
+   the parent's own display, so any variable is at most two loads away. */
+void init_display(uint32_t env, uint32_t func) {
+  uint32_t display = FUNC_DISPLAY(func), *slots = VECTOR_START(env);
+  if (display == 0) return;
+  slots[0] = FUNC_ENV(func);
+  if (display > 1)
+    memcpy(slots+1, VECTOR_START(FUNC_ENV(func)), (display-1)*sizeof(uint32_t));
+}
+
+/* for a lexical variable only; globals aren't in a frame */
 uint32_t follow_frame(uint32_t env, uint32_t frame) {
-  while (frame > 0) {
-    if (env == 0) die("bad frame or env in find_frame");
-    env = VECTOR_START(env)[0]; frame--;
-  }
-  if (env == 0) die("bad frame or env in find_frame");
-  return env;
+  if (frame == 0) return env;
+  STAT(stats.frame_hops++);
+  return VECTOR_START(env)[frame-1];
 }
 
 /* checks that index is a proper ()-terminated list with 
@@ -121,40 +224,77 @@ int length_list(uint32_t index) {
 
 /* helper functions to store stuff into cells */
 
-uint32_t store_string(char *str, char *end, int type) {
-  uint32_t len = (end-str+7)/8;
-  CHECK_CELLS(len+1);
+/* a string or symbol of size bytes, for the caller to fill in; any
+   size up to MAX_STRING, in 64 bits so that the rounding up can't wrap */
+uint32_t make_string(uint32_t size, int type) {
+  uint32_t len = ((uint64_t)size+7)/8;
+  CHECK_CELLS(CELLS_EVEN(len+1));
+  STAT(stats.cells[type] += CELLS_EVEN(len+1));
+  if (alloc_profiling)
+    profile_alloc(type == T_SYM ? ALLOC_SYMBOL : ALLOC_STRING, CELLS_EVEN(len+1));
   uint32_t index = next_cell;
-  uint64_t value = type | (uint64_t)len << 16 | (uint64_t)(end-str) << 32;
-  cells[next_cell++] = value;
-  strncpy(STR_START(index), str, end-str);
-  next_cell+=len;
+  cells[next_cell++] = type | (uint64_t)size << 32;
+  /* cells get reused after a collection, so zero out the padding */
+  if (len > 0) cells[next_cell+len-1] = 0;
+  next_cell = index + CELLS_EVEN(len+1);
+  return index;
+}
+
+uint32_t store_string(char *str, char *end, int type) {
+  uint32_t index = make_string(end-str, type);
+  memcpy(STR_START(index), str, end-str);
   return index;
 }
 
 uint32_t store_pair(uint32_t first, uint32_t second) {
   uint64_t  value = T_PAIR;
-  CHECK_CELLS(2);
+  if (HEAP_FULL(2)) {
+    GC_ROOT(first); GC_ROOT(second);
+    gc_collect(2);
+    GC_UNROOT(2);
+  }
+  STAT(stats.cells[T_PAIR] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_PAIR, 2);
   uint32_t  index = next_cell;
   cells[next_cell++] = value;
   cells[next_cell++] = ((uint64_t)first << 32) | second;
   return index;
 }
 
+/* boxes num only if it doesn't fit in a fixnum */
 uint32_t store_int32(int32_t num) {
+  if (num >= FIXNUM_MIN && num <= FIXNUM_MAX) return MAKE_FIXNUM(num);
   uint64_t value = T_INT32;
-  CHECK_CELLS(1);
+  CHECK_CELLS(2);
+  STAT(stats.cells[T_INT32] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_INTEGER, 2);
   uint32_t index = next_cell;
-  cells[next_cell++] = value | ((uint64_t)(uint32_t)num) << 32;
+  cells[index] = value | ((uint64_t)(uint32_t)num) << 32;
+  next_cell += 2;
+  return index;
+}
+
+uint32_t store_flonum(double num) {
+  union flo_bits flo = {.value = num};
+  CHECK_CELLS(2);
+  STAT(stats.cells[T_FLO] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_FLONUM, 2);
+  uint32_t index = next_cell;
+  cells[index] = T_FLO;
+  cells[index+1] = flo.bits;
+  next_cell += 2;
   return index;
 }
 
 uint32_t store_var(uint32_t slot, uint32_t frame) {
   uint64_t value = T_VAR;
-  CHECK_CELLS(1);
+  if (frame == GLOBAL_FRAME) reserve_globals(slot+1);
+  CHECK_CELLS(2);
+  STAT(stats.cells[T_VAR] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_CODE, 2);
   uint32_t index = next_cell;
-  cells[next_cell++] = value | ((uint64_t)frame << 32) |
-                         (uint64_t)slot << 48;
+  cells[index] = value | ((uint64_t)frame << 16) | (uint64_t)slot << 32;
+  next_cell += 2;
   return index;
 }
 
@@ -165,15 +305,20 @@ int read_vector(char **pstr, uint32_t *pindex) {
   uint32_t *indices = initial_indices;
   int malloced = 0;
   char *str = *pstr;
+  /* the elements read so far are a gc root, updated as we go */
+  uint32_t root = gc_num_roots;
+  GC_ROOTS(indices, 0);
   while(1) {
     SKIP_WS(str);
     if (*str == ')') break;
     int res = read_value(&str, &indices[cur_index], 0);
-    if (!res) { 
+    if (!res) {
       if (malloced) free(indices);
+      GC_UNROOT(1);
       return 0;
     }
     cur_index++;
+    gc_roots[root].count = cur_index;
     if (cur_index >= max_index) {  /* need to grow */
       max_index *= 2;
       indices = malloced ? realloc(indices, max_index*sizeof(uint32_t))
@@ -183,6 +328,7 @@ int read_vector(char **pstr, uint32_t *pindex) {
         memcpy(indices, initial_indices, 2*sizeof(uint32_t));
         malloced = 1;
       }
+      gc_roots[root].ptr = indices;
     }
   }
   /* we've seen ')' and all is good. store and cleanup */
@@ -191,6 +337,7 @@ int read_vector(char **pstr, uint32_t *pindex) {
   uint32_t index = make_vector(cur_index, 0);
   memcpy(VECTOR_START(index), indices, cur_index*sizeof(uint32_t));
   if(malloced) free(indices);
+  GC_UNROOT(1);
   *pindex = index;
   *pstr = str;
   return 1;
@@ -200,11 +347,19 @@ int read_vector(char **pstr, uint32_t *pindex) {
    1 means success.
   -1 means "string ended expectedly, feel free to ask for more input" */
 
+int read_datum(char **pstr, uint32_t *pindex, int implicit_paren);
+
+/* takes care of the gc roots read_datum() leaves on its many exit paths */
 int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
+  uint32_t saved_roots = gc_num_roots;
+  int res = read_datum(pstr, pindex, implicit_paren);
+  gc_num_roots = saved_roots;
+  return res;
+}
+
+int read_datum(char **pstr, uint32_t *pindex, int implicit_paren) {
   char *str = *pstr;
-  int num, count;
-  uint64_t value;
-  uint32_t index = next_cell;
+  uint32_t index;
 
   SKIP_WS(str);
   if (implicit_paren || *str == '(') {
@@ -219,10 +374,11 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
     uint32_t index1;
     int res = read_value(&str, &index1, 0);
     if (!res) return 0;
+    GC_ROOT(index1);
 
     SKIP_WS(str);
     int dot_pair = 0;
-    if (*str == '.' && isspace(*(str+1))) {
+    if (*str == '.' && CHAR_IS(*(str+1), CC_SPACE)) {
       dot_pair = 1;
       str++;
     }
@@ -261,10 +417,7 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
     } else {
       c = *str; str+=1;
     }
-    index = next_cell;
-    uint64_t value = T_CHAR | (uint64_t)c << 32;
-    cells[next_cell++] = value;
-    *pindex = index;
+    *pindex = MAKE_CHAR(c);
     *pstr = str;
     return 1;
   }
@@ -277,12 +430,50 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
     *pstr = str+2; *pindex = C_TRUE; return 1;
   }
     
-  if (sscanf(str, "%d%n", &num, &count) >= 1) {
-    str += count;
-    value = T_INT32 | ((uint64_t)num << 32);
-    CHECK_CELLS(1);
-    cells[next_cell++] = value;
-    *pindex = index;
+  /* the flonums print_flonum() writes without digits */
+  if ((*str == '+' || *str == '-') && (strncmp(str+1, "inf.0", 5) == 0 ||
+                                       strncmp(str+1, "nan.0", 5) == 0) &&
+      !CHAR_IS(str[6], CC_SUBSEQUENT)) {
+    double num = str[1] == 'i' ? INFINITY : NAN;
+    *pindex = store_flonum(*str == '-' ? -num : num);
+    *pstr = str+6;
+    return 1;
+  }
+
+  /* a number: maybe a sign, digits, maybe a fraction and an exponent */
+  char *digits = str + (*str == '+' || *str == '-');
+  if (CHAR_IS(*digits, CC_DIGIT) ||
+      (*digits == '.' && CHAR_IS(*(digits+1), CC_DIGIT))) {
+    char *start = str;
+    int negative = (*str == '-');
+    str = digits;
+    int64_t num = 0;
+    while(CHAR_IS(*str, CC_DIGIT)) {
+      if (num <= (int64_t)INT32_MAX + 1) num = num*10 + (*str - '0');
+      str++;
+    }
+    char *end = str;
+    if (*end == '.') {
+      end++;
+      while(CHAR_IS(*end, CC_DIGIT)) end++;
+    }
+    if (*end == 'e' || *end == 'E') {
+      char *exponent = end+1;
+      if (*exponent == '+' || *exponent == '-') exponent++;
+      if (CHAR_IS(*exponent, CC_DIGIT)) {
+        end = exponent;
+        while(CHAR_IS(*end, CC_DIGIT)) end++;
+      }
+    }
+    if (end != str) {  /* not an integer */
+      *pindex = store_flonum(strtod(start, 0));
+      *pstr = end;
+      return 1;
+    }
+    if (negative) num = -num;
+    if (num >= INT32_MIN && num <= INT32_MAX)
+      *pindex = store_int32((int32_t)num);
+    else *pindex = read_bignum(digits, str - digits, negative);
     *pstr = str;
     return 1;
   }
@@ -301,8 +492,9 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
     uint32_t indices[2];
     int res = read_value(&str, &indices[1], 0);
     if (!res) return 0;
-    char *quote = "quote";
-    indices[0] = store_string(quote, quote+5, T_SYM);
+    indices[0] = C_EMPTY;
+    GC_ROOTS(indices, 2);
+    indices[0] = sym_quote;
     *pindex = make_list(indices, 2);
     *pstr = str;
     return 1;
@@ -321,14 +513,14 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
   }
 
   /* regular identifiers */
-  if (!symbol && INITIAL(*str)) {
+  if (!symbol && CHAR_IS(*str, CC_INITIAL)) {
     symbol = 1;
     end = str+1;
-    while(SUBSEQUENT(*end)) end++;
+    while(CHAR_IS(*end, CC_SUBSEQUENT)) end++;
   }
 
   if (symbol) {
-    *pindex = store_string(str, end, T_SYM);
+    *pindex = intern_symbol(str, end-str);
     *pstr = end;
     return 1;
   }
@@ -336,6 +528,18 @@ int read_value(char **pstr, uint32_t *pindex, int implicit_paren) {
   return 0;
 }
 
+/* the shortest of %.15g and %.17g that reads back the same, with a
+   point so it reads back as a flonum at all */
+void print_flonum(double num) {
+  char buf[32];
+  if (isnan(num)) { printf("+nan.0"); return; }
+  if (isinf(num)) { printf(num > 0 ? "+inf.0" : "-inf.0"); return; }
+  snprintf(buf, sizeof(buf), "%.15g", num);
+  if (strtod(buf, 0) != num) snprintf(buf, sizeof(buf), "%.17g", num);
+  printf("%s", buf);
+  if (!strpbrk(buf, ".e")) printf(".0");
+}
+
 void dump_value(uint32_t index, int implicit_paren) {
   uint32_t length, i;
   uint32_t index1, index2;
@@ -353,6 +557,18 @@ void dump_value(uint32_t index, int implicit_paren) {
       num = INT32_VALUE(index);
       printf("%d", num);
       break;
+    case T_BIG:
+      print_bignum(index);
+      break;
+    case T_FLO:
+      print_flonum(FLO_VALUE(index));
+      break;
+    case T_NVEC:
+      print_nvector(index);
+      break;
+    case T_BUILDER:
+      printf("*string-builder*");
+      break;
     case T_STR:
       length = STR_LEN(index);
       p = STR_START(index);
@@ -411,19 +627,56 @@ void dump_value(uint32_t index, int implicit_paren) {
     case T_VAR:
       printf("#<var:%u,%u>", VAR_SLOT(index), VAR_FRAME(index));
       break;
+    case T_CODE:
+      dump_value(CODE_SOURCE(index), implicit_paren);
+      break;
+    case T_SPECIAL:
+      switch (SPECIAL_FORM(index)) {
+        case F_DEFINE: printf("define"); break;
+        case F_SET: printf("set!"); break;
+        case F_QUOTE: printf("quote"); break;
+        case F_IF: printf("if"); break;
+        case F_ADD: printf("+"); break;
+        case F_SUB: printf("-"); break;
+        case F_MUL: printf("*"); break;
+        case F_LT: printf("<"); break;
+        case F_NUMEQ: printf("="); break;
+        case F_QUOTIENT: printf("quotient"); break;
+        case F_REMAINDER: printf("remainder"); break;
+        default: die("unknown special form");
+      }
+      break;
     default:
       break;
   }
 }
 
-/* we count on the compiler to precompute constant strlens */
-#define IS_SYMBOL(index, name) (STR_LEN(index) == strlen(name) && \
-                                strcmp(STR_START(index), name) == 0)
+/* symbols are interned, so this is just an index compare */
+#define IS_SYMBOL(index, sym) ((index) == (sym))
 
 uint32_t prepare_list(uint32_t list);
 uint32_t prepare_lambda(uint32_t args);
+uint32_t prepare_form(uint32_t index, uint32_t *deferred_define);
+
+/* For the profiler: the symbol a define is about to bind to the lambda
+   prepared next, and the name of the lambda being prepared. */
+static uint32_t lambda_name = 0;
+static const char *current_site = 0;
 
+static void name_lambda(uint32_t sym, uint32_t value) {
+  if (profiling && TYPE(value) == T_PAIR && IS_SYMBOL(CAR(value), sym_lambda))
+    lambda_name = sym;
+}
+
+/* takes care of the gc roots prepare_form() leaves on its exit paths */
 uint32_t prepare(uint32_t index, uint32_t *deferred_define) {
+  uint32_t saved_roots = gc_num_roots;
+  uint32_t res = prepare_form(index, deferred_define);
+  gc_num_roots = saved_roots;
+  return res;
+}
+
+uint32_t prepare_form(uint32_t index, uint32_t *deferred_define) {
   uint32_t slot, frame, func, args, sym;
   int res;
   switch(TYPE(index)) {
@@ -439,31 +692,44 @@ uint32_t prepare(uint32_t index, uint32_t *deferred_define) {
       }
       break;
     case T_PAIR:
+      GC_ROOT(index);
       func = CAR(index);
       args = CDR(index);
+      GC_ROOT(args);
       if (!LIST_LIKE(args)) {
         printf("A dot pair but not a list in prepare()\n");
         return 0;
       };
+      /* Special forms get their keyword replaced with a T_SPECIAL, so that
+         eval() can tell them apart without looking at symbols. Their
+         syntax is checked here, once, rather than on every evaluation. */
       if (TYPE(func) == T_SYM) {
-        if (IS_SYMBOL(func, "quote")) return index;
+        if (IS_SYMBOL(func, sym_quote)) {
+          if (!check_list(args, 1, 1)) die("bad quote syntax");
+          SET_CAR(index, C_QUOTE);
+          return index;
+        }
 
-        if (IS_SYMBOL(func, "define")) {
+        if (IS_SYMBOL(func, sym_define)) {
           if (!check_list(args, 2, 1)) die("bad define/set! syntax");
           sym = CAR(args);
           if (TYPE(sym) != T_SYM) die("bad define syntax in prepare");
+          GC_ROOT(sym);
+          SET_CAR(index, C_DEFINE);
           add_symbol(STR_START(sym), STR_LEN(sym), &slot, &frame);
           uint32_t var = store_var(slot, frame);
           SET_CAR(args, var);
           if (deferred_define) { 
-            *deferred_define = CDR(args);  /* (val) not val, deliberately. */
+            /* (sym val): the name is kept for name_lambda() */
+            *deferred_define = store_pair(sym, CDR(args));
           } else { 
+            name_lambda(sym, CAR(CDR(args)));
             if (prepare_list(CDR(args)) == 0) return 0;
           }
           return index;
         }
 
-        if (IS_SYMBOL(func, "lambda")) {
+        if (IS_SYMBOL(func, sym_lambda)) {
           /* Easier to add/delete symbol tables here than chase exit points
              in prepare_lambda(). */
           add_symbol_table();
@@ -472,17 +738,33 @@ uint32_t prepare(uint32_t index, uint32_t *deferred_define) {
           return res;
         }
 
-        /* Special forms that don't exist in the symbol table. TODO: simplify. */
-        if (IS_SYMBOL(func, "set!") || IS_SYMBOL(func, "if")) {
-          /* only walk the args */
-          uint32_t res = prepare_list(args);
-          if (res == 0) return 0;
+        if (IS_SYMBOL(func, sym_set)) {
+          if (!check_list(args, 2, 1)) die("bad define/set! syntax");
+          if (TYPE(CAR(args)) != T_SYM) die("bad set! syntax in prepare");
+          SET_CAR(index, C_SET);
+          if (prepare_list(args) == 0) return 0;
+          return index;
+        }
+
+        if (IS_SYMBOL(func, sym_if)) {
+          int len = length_list(args);
+          if (!(len == 2 || len == 3)) die("bad if syntax");
+          SET_CAR(index, C_IF);
+          if (prepare_list(args) == 0) return 0;
           return index;
         }
       }
       /* The usual case: resolve the list recursively. */
-      return prepare_list(index);
-      break;
+      if (prepare_list(index) == 0) return 0;
+      /* a call of a builtin that eval() can do inline */
+      func = CAR(index);
+      if (TYPE(func) == T_VAR && VAR_FRAME(func) == GLOBAL_FRAME &&
+          length_list(args) == 2) {
+        int form = primitive_of(VAR_SLOT(func));
+        uint32_t special = C_ADD + 2*(form - F_ADD);
+        if (form >= 0) SET_CAR(index, special);
+      }
+      return index;
     default:
       break;
   }
@@ -494,21 +776,38 @@ uint32_t prepare(uint32_t index, uint32_t *deferred_define) {
 uint32_t prepare_list(uint32_t list) {
   if (!check_list(list, 0, 0)) die("bad list given to prepare_list()");
   uint32_t orig_list = list;
+  GC_ROOT(orig_list); GC_ROOT(list);
   while(list != C_EMPTY) {
     uint32_t res = prepare(CAR(list), 0);
-    if (res == 0) return 0;
+    if (res == 0) {
+      GC_UNROOT(2);
+      return 0;
+    }
     if (res != CAR(list)) SET_CAR(list, res);
     list = CDR(list);
   }
+  GC_UNROOT(2);
   return orig_list;
 }
 
+/* counts the lambdas prepared so far, to tell which ones contain others */
+static uint32_t lambdas_prepared = 0;
+
 /* maximum number of define statements inside one lambda */
 #define MAX_INTERNAL_DEFINES 1000
 uint32_t prepare_lambda(uint32_t args) {
   uint32_t defines[MAX_INTERNAL_DEFINES];
   uint32_t defines_curr = 0;
   uint32_t slot, frame;
+  uint32_t saved_roots = gc_num_roots;
+  uint32_t lambdas_inside = lambdas_prepared;
+  /* the display slots past the parent come first in the new table */
+  uint32_t display = latest_table_size();
+  const char *outer_site = current_site;
+  if (profiling) {
+    current_site = profile_site_name(lambda_name, outer_site);
+    lambda_name = 0;
+  }
 
   /* Basic argument correctness. */
   int len = length_list(args);
@@ -527,14 +826,21 @@ uint32_t prepare_lambda(uint32_t args) {
           
   /* Go over the body and walk it recursively, deferring defines. */
   uint32_t body = CDR(args);
+  uint32_t defines_root = gc_num_roots;
+  GC_ROOTS(defines, 0);
+  GC_ROOT(args); GC_ROOT(body);
   while (body != C_EMPTY) {
-    uint32_t statement = CAR(body);
     defines[defines_curr] = 0;
-    uint32_t res = prepare(statement, &defines[defines_curr]);
-    if (res == 0) return 0;
-    if (res != statement) SET_CAR(body, res);
+    uint32_t res = prepare(CAR(body), &defines[defines_curr]);
+    if (res == 0) {
+      gc_num_roots = saved_roots;
+      current_site = outer_site;
+      return 0;
+    }
+    if (res != CAR(body)) SET_CAR(body, res);
     if (defines[defines_curr] != 0) {
       ++defines_curr;
+      gc_roots[defines_root].count = defines_curr;
       if (defines_curr >= MAX_INTERNAL_DEFINES) die("too many internal defines");
     }
     body = CDR(body);
@@ -542,225 +848,374 @@ uint32_t prepare_lambda(uint32_t args) {
   
   /* Go over deferred define bodies, if any. */
   for (int i = 0; i < defines_curr; i++) {
-    uint32_t res = prepare_list(defines[i]);
-    if (res == 0) return 0;
+    name_lambda(CAR(defines[i]), CAR(CDR(defines[i])));
+    uint32_t res = prepare_list(CDR(defines[i]));
+    if (res == 0) {
+      gc_num_roots = saved_roots;
+      current_site = outer_site;
+      return 0;
+    }
   }
 
+  /* With the VM, the body is compiled once, here. */
+  body = CDR(args);
+  if (use_vm) body = compile_body(body);
+
   /* Create a T_FUNC, record the number of slots. */
   CHECK_CELLS(2);
+  STAT(stats.cells[T_FUNC] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_CODE, 2);
   uint32_t index = next_cell;
   uint64_t value = T_FUNC;
   uint32_t count_vars = latest_table_size();
   value |= (uint64_t)count_vars << 32;
   value |= (uint64_t)args_number << 48;
+  value |= (uint64_t)display << 16;
+  /* Only closures made in an environment hold on to it, and the body
+     can't make any if it has no lambdas in it. */
+  if (lambdas_prepared == lambdas_inside) value |= LEAF_MASK;
+  lambdas_prepared++;
   cells[next_cell++] = value;
 
   // Higher 32-bit will be an env pointer in closures. */
-  cells[next_cell++] = (uint64_t)CDR(args);
+  cells[next_cell++] = (uint64_t)body;
+  if (profiling) profile_add_site(body, current_site);
+  current_site = outer_site;
+  gc_num_roots = saved_roots;
   return index;
 }
 
 uint32_t eval(uint32_t index, uint32_t env);
 
-/* returns true/false on success/failure */
-int eval_args(uint32_t list, uint32_t env, uint32_t *args, uint32_t *num_args) {
-  uint32_t count = 0;
+/* A global holds 0 until a define of it succeeds, and reading it before
+   then is the same error prepare() gives for a name it doesn't know.
+   Both evaluators report it through here. */
+void undefined_global(uint32_t slot) {
+  const char *name;
+  int len;
+  printf("Undefined variable: ");
+  if (global_name(slot, &name, &len)) printf("%.*s", len, name);
+  putchar('\n');
+}
+
+/* Evaluated arguments of the calls in progress. They live here rather
+   than in a local array in eval(), so that a deep recursion doesn't
+   take a kilobyte of C stack per level. Anything that may evaluate or
+   allocate can move the stack, so refer to its contents by offset. */
+static uint32_t *arg_stack;
+static uint32_t arg_top = 0, arg_max = 0;
+
+static void visit_args(void (*visit)(uint32_t *)) {
+  for (uint32_t i = 0; i < arg_top; i++) visit(&arg_stack[i]);
+}
+
+static void push_arg(uint32_t value) {
+  if (arg_top == arg_max) {
+    arg_max = arg_max ? arg_max*2 : 4096;
+    arg_stack = realloc(arg_stack, arg_max*sizeof(uint32_t));
+    if (arg_stack == 0) die("couldn't alloc memory for the arg stack");
+  }
+  arg_stack[arg_top++] = value;
+}
+
+/* returns true/false on success/failure. On success, the evaluated
+   args are left on top of the arg stack, for the caller to pop. */
+int eval_args(uint32_t list, uint32_t env, uint32_t *num_args) {
+  uint32_t count = 0, val;
+  GC_ROOT(list); GC_ROOT(env);
   while(count < MAX_ARGS && list != C_EMPTY) {
-    args[count] = eval(CAR(list), env);
-    if (args[count] == 0) return 0;
+    val = eval(CAR(list), env);
+    if (val == 0) {
+      arg_top -= count;
+      GC_UNROOT(2);
+      return 0;
+    }
+    push_arg(val);
     count++;
     list = CDR(list);
     if (!LIST_LIKE(list))
       die("badly formed argument list");
   }
   if (count >= MAX_ARGS) die("more than MAX_ARGS arguments");
+  GC_UNROOT(2);
   *num_args = count;
   return 1;
 }
 
+/* how deep eval() is in itself, kept under MAX_EVAL_DEPTH so that a
+   deep recursion dies with a message rather than overflowing the C
+   stack */
+static uint32_t eval_depth = 0;
+
+/* Forms in tail position - the branches of an if, the last form in a
+   lambda body - are evaluated by jumping back to the top rather than
+   by recursing, so tail-recursive loops run in constant C stack. */
 uint32_t eval(uint32_t index, uint32_t env) {
-  uint32_t var, val, func, args;
-  uint32_t arg_array[MAX_ARGS];
-  uint32_t var_env;
+  uint32_t var, val, func, args, body;
+  uint32_t var_env, new_env, num_args, base;
+  uint32_t saved_roots = gc_num_roots, saved_args = arg_top;
+  uint32_t saved_frames = frame_top, saved_profile = profile_top;
+  int rooted = 0;
+  if (++eval_depth > MAX_EVAL_DEPTH)
+    die("eval nested too deep (non-tail calls in --tree-walk)");
+  STAT(if (eval_depth > stats.max_eval_depth)
+         stats.max_eval_depth = eval_depth);
+
+/* roots may have been pushed on an earlier pass through tail */
+#define EVAL_RETURN(value) do { gc_num_roots = saved_roots; \
+    arg_top = saved_args; frame_top = saved_frames; \
+    profile_top = saved_profile; \
+    eval_depth--; return (value); } while(0)
+
+tail:
   switch(TYPE(index)) {
     case T_INT32:
+    case T_BIG:
+    case T_FLO:
     case T_RESV:
     case T_STR:
     case T_CHAR:
-      return index;
+    case T_VECT:
+    case T_NVEC:
+      EVAL_RETURN(index);
     case T_SYM:
       printf("eval: should not get a naked symbol");
-      return 0;
+      EVAL_RETURN(0);
     case T_VAR:
+      if (VAR_FRAME(index) == GLOBAL_FRAME) {
+        val = globals[VAR_SLOT(index)];
+        if (val == 0) undefined_global(VAR_SLOT(index));
+        EVAL_RETURN(val);
+      }
       var_env = follow_frame(env, VAR_FRAME(index));
-      return VECTOR_START(var_env)[VAR_SLOT(index)];
+      EVAL_RETURN(VECTOR_START(var_env)[VAR_SLOT(index)]);
     case T_FUNC:
       /* Executing a lambda form. */
       if ((cells[index] & BLTIN_MASK) != 0) {
         printf("evaluating a naked builtin func shouldn't be possible.\n");
-        return 0;
+        EVAL_RETURN(0);
       }
       if (FUNC_ENV(index) != 0) {
         printf("evaluating a naked closure shouldn't be possible.\n");
-        return 0;
+        EVAL_RETURN(0);
       }
-      /* Copy the T_FUNC and set its environment. */
-      CHECK_CELLS(2);
+      /* Copy the T_FUNC and set its environment. Coming through tail,
+         index and env are rooted already, and rooting them twice would
+         have the collector update them twice. */
+      if (HEAP_FULL(2)) {
+        if (!rooted) { GC_ROOT(index); GC_ROOT(env); }
+        gc_collect(2);
+      }
+      STAT(stats.cells[T_FUNC] += 2);
+      if (alloc_profiling) profile_alloc(ALLOC_CLOSURE, 2);
       uint32_t new_index = next_cell;
       cells[next_cell++] = cells[index];
       cells[next_cell++] = cells[index+1];
       SET_CAR(new_index, env);
-      return new_index;
+      EVAL_RETURN(new_index);
     case T_PAIR:
+      if (!rooted) {
+        args = val = body = 0;
+        GC_ROOT(index); GC_ROOT(env); GC_ROOT(args);
+        GC_ROOT(val); GC_ROOT(body);
+        rooted = 1;
+      }
       func = CAR(index);
       args = CDR(index);
       if (!LIST_LIKE(args)) die("args to eval aren't a list");
 
-      /* special-case special forms here. Don't try to eval 'func'
-         until we have special forms as proper symbols. */
-      if (TYPE(func) == T_SYM) {
-        int is_define = IS_SYMBOL(func, "define");
-        int is_set = IS_SYMBOL(func, "set!");
-        if (is_define || is_set) {
-          /* the only allowed syntax here is ([define/set!] symbol value) */
-          if (!check_list(args, 2, 1)) die("bad define/set! syntax");
-          var = CAR(args);
-          val = CAR(CDR(args));
-          val = eval(val, env);
-          if (val == 0) die("couldn't eval the value in define/set!");
- 
-          if (TYPE(var) != T_VAR) die ("not a variable in define/set");
-          uint32_t var_env = follow_frame(env, VAR_FRAME(var));
-          store_env(var_env, VAR_SLOT(var), val);
-          return C_UNSPEC;
-        }
-
-        if (IS_SYMBOL(func, "quote")) {
-          /* syntax is: (quote value) */
-          if (!check_list(args, 1, 1)) die ("bad quote syntax");
-          return CAR(args);
-        }
-
-        if (IS_SYMBOL(func, "if")) {
-          int len = length_list(args);
-          if (!(len == 2 || len == 3)) die("bad if syntax");
-          val = eval(CAR(args), env); /* condition */
-          if (val != C_FALSE) {  /* only #if is false */
-            return eval(CAR(CDR(args)), env);
-          } else {
-            if (len == 3) return eval(CAR(CDR(CDR(args))), env);
-            else return C_UNSPEC;
-          }
+      /* special forms were resolved and their syntax checked by prepare() */
+      if (TYPE(func) == T_SPECIAL) {
+        switch (SPECIAL_FORM(func)) {
+          case F_DEFINE:
+          case F_SET:
+            /* ([define/set!] var value) */
+            val = eval(CAR(CDR(args)), env);
+            if (val == 0) die("couldn't eval the value in define/set!");
+            var = CAR(args);
+            if (VAR_FRAME(var) == GLOBAL_FRAME) {
+              globals[VAR_SLOT(var)] = val;
+            } else {
+              var_env = follow_frame(env, VAR_FRAME(var));
+              store_env(var_env, VAR_SLOT(var), val);
+            }
+            EVAL_RETURN(C_UNSPEC);
+          case F_QUOTE:
+            EVAL_RETURN(CAR(args));
+          case F_IF:
+            val = eval(CAR(args), env); /* condition */
+            if (val == 0) EVAL_RETURN(0);
+            if (val != C_FALSE) {  /* only #f is false */
+              index = CAR(CDR(args));
+            } else {
+              args = CDR(CDR(args));
+              if (args == C_EMPTY) EVAL_RETURN(C_UNSPEC);
+              index = CAR(args);
+            }
+            goto tail;
+          default:
+            /* a primitive: with fixnums, no call at all; otherwise a
+               call of whatever the global is now */
+            if (!eval_args(args, env, &num_args)) EVAL_RETURN(0);
+            if (primitive_intact(SPECIAL_FORM(func)) &&
+                fixnum_primitive(SPECIAL_FORM(func), arg_stack[arg_top-2],
+                                 arg_stack[arg_top-1], &val))
+              EVAL_RETURN(val);
+            val = globals[primitive_slot(SPECIAL_FORM(func))];
+            goto apply;
         }
       }
 
-      /* special forms end here. Now eval the first element and check
-         that it's a function. */
+      /* special forms end here. Now eval the first element, and the
+         arguments, and call the function. */
       val = eval(func, env);
       if (val == 0) die("undefined symbol as func name");
+      if (!eval_args(args, env, &num_args)) EVAL_RETURN(0);
+apply:
       if (TYPE(val) != T_FUNC) die("first element in list not a function");
-
-      /* evaluate arguments and call the function */
-      uint32_t num_args;
-      if (!eval_args(args, env, arg_array, &num_args)) return 0;
+      base = arg_top - num_args;
       if (cells[val] & BLTIN_MASK) {   /* builtin function */
-         /* TODO: do we really need a list for builtin funcs? Reevaluate the
-            interface to them after lexical scoping & tail calls are done. */
-         uint32_t list = make_list(arg_array, num_args);
-         builtin_t func = (builtin_t)cells[val+1];
-        /* well, there you go */
-        return func(list);
+        if (!BLTIN_ARGS_OK(val, num_args)) {
+          printf("eval: number of args mismatch.\n");
+          EVAL_RETURN(0);
+        }
+        STAT(stats.builtin_calls[BLTIN_ID(val)]++);
+        if (profiling) profile_builtin(BLTIN_ID(val));
+        builtin_t func = (builtin_t)cells[val+1];
+        /* well, there you go; the args stay rooted until it returns */
+        val = func(arg_stack+base, num_args);
+        if (profiling) profile_builtin_id = 0;
+        EVAL_RETURN(val);
       } else {  /* lambda function */
-        uint32_t body = FUNC_BODY(val);
         if (num_args != FUNC_ARGCOUNT(val)) {
           printf("eval: number of args mismatch.\n");
-          return 0;
+          EVAL_RETURN(0);
         }
         /* Create a new environment, tied to the one stored in T_FUNC. */
         /* If we did our job right, zero_it in the call to make_env() is
            not necessary. */
-        uint32_t new_env = make_env(FUNC_VARCOUNT(val), 0);
-        VECTOR_START(new_env)[0] = FUNC_ENV(val);
+        STAT(stats.lambda_calls++);
+        /* a tail call takes the place of the lambda we were in, if any */
+        if (profiling) {
+          profile_top = saved_profile;
+          profile_call(FUNC_BODY(val));
+        }
+        /* an earlier pass through tail may have left a frame stack
+           environment that's now dead, as env is about to be replaced */
+        frame_top = saved_frames;
+        new_env = 0;
+        if (cells[val] & LEAF_MASK)
+          new_env = make_frame_env(FUNC_VARCOUNT(val));
+        if (new_env == 0) new_env = make_env(FUNC_VARCOUNT(val));
+        init_display(new_env, val);
         for (uint32_t i = 0; i < num_args; i++) {
-          store_env(new_env, i+1, arg_array[i]);
+          store_env(new_env, FUNC_DISPLAY(val)+i, arg_stack[base+i]);
         }
-        uint32_t retval = C_UNSPEC;
-        while (body != C_EMPTY) {
-          retval = eval(CAR(body), new_env);
-          if (retval == 0) return 0;
+        arg_top = base;
+        /* the caller's env isn't needed anymore, we're replacing it */
+        env = new_env;
+        body = FUNC_BODY(val);
+        if (TYPE(body) == T_CODE) body = CODE_SOURCE(body);
+        if (body == C_EMPTY) EVAL_RETURN(C_UNSPEC);
+        while (CDR(body) != C_EMPTY) {
+          if (eval(CAR(body), env) == 0) EVAL_RETURN(0);
           body = CDR(body);
         }
-        return retval;
+        index = CAR(body);
+        goto tail;
       }
     default:
-      return 0;
+      EVAL_RETURN(0);
   }
+#undef EVAL_RETURN
 }
 
-/* 1 if we seem to be inside a list or a string, based on parens parity */
-int in_flight(char *str) {
-  int paren_level = 0;
-  int in_string = 0;
-  while (*str) {
-    if (*str == '(' && !in_string) paren_level++;
-    if (*str == ')' && !in_string) {
-      if (paren_level == 0) return 0;
-      else paren_level--;
-    }
-    if (*str == '#' && *(str+1) == '\\' && !in_string) str+=2;
-    if (*str == '\\' && in_string) str++;
-    if (*str == '"') in_string = !in_string;
-    str++;
-  }
-  return (paren_level > 0 || in_string);
+/* Prepares and evaluates a form read at the toplevel. Returns its value,
+   or 0 after saying what went wrong. */
+static uint32_t prepare_toplevel(uint32_t index) {
+  uint32_t prepared = prepare(index, 0);
+  if (!prepared) printf("failed preparing.\n");
+  return prepared;
 }
 
-#define LINE_MAX 20000
-char buf[LINE_MAX];
+uint32_t eval_prepared(uint32_t prepared) {
+  uint32_t res;
+  /* toplevel forms have no environment, only globals */
+  if (use_vm) res = vm_run(compile_toplevel(prepared), 0);
+  else res = eval(prepared, 0);
+  if (!res) printf("eval failed.\n");
+  return res;
+}
 
-int main(int argc, char **argv) {
-  init_cells();
-  add_symbol_table();  /* for the global environment */
-  toplevel_env = make_env(10000, 1);
-  register_builtins();
+uint32_t eval_toplevel(uint32_t index) {
+  uint32_t prepared = prepare_toplevel(index);
+  return prepared ? eval_prepared(prepared) : 0;
+}
 
-  while(1) {
-    printf("%d cells> ", next_cell);
-    buf[0] = '\0';
-    while(1) {
-      int size = strlen(buf);
-      if (size + 512 > LINE_MAX) die("input line too long");
-      if (fgets(buf+size, 512, stdin) == 0) {
-        if (feof(stdin)) return 0;
-        else die("fgets() failed");
-      }
-      if (in_flight(buf)) {
-        printf("... ");
-        continue;  /* read more */
-      }
-      break;
-    }  
-    char *str = buf;
-    uint32_t index;
-    if (!read_value(&str, &index, 0)) {
-      printf("failed reading at: %s\n", str);
-      continue;
+/* Reads and evaluates all the forms in a file, one after another, and
+   doesn't print their values. Returns 1 if all went well; stops at the
+   first form that fails. With cache set, goes through a fasl cache of
+   the prepared forms (see fasl.c). */
+int load_file(const char *path, int cache) {
+  FILE *file = fopen(path, "r");
+  if (file == 0) {
+    printf("can't open %s\n", path);
+    return 0;
+  }
+  size_t size = 0, max_size = 1 << 16, count;
+  char *text = malloc(max_size);
+  if (text == 0) die("couldn't alloc memory for a file");
+  while ((count = fread(text+size, 1, max_size-size-1, file)) > 0) {
+    size += count;
+    if (size == max_size-1) {
+      max_size *= 2;
+      text = realloc(text, max_size);
+      if (text == 0) die("couldn't alloc memory for a file");
     }
-
-    uint32_t prepared = prepare(index, 0);
-    if (!prepared) {
-      printf("failed preparing.\n");
-      continue;
+  }
+  int ok = !ferror(file);
+  fclose(file);
+  text[size] = '\0';
+
+  struct fasl *fasl = 0;
+  if (ok && cache && !profiling && !alloc_profiling) {
+    int res = fasl_load(path, text, size);
+    if (res >= 0) {
+      free(text);
+      return res;
     }
-      
-    uint32_t res = eval(prepared, toplevel_env);
-    if (!res) {
-      printf("eval failed.\n");
-      continue;
+    fasl = fasl_begin(text, size);
+  }
+  char *str = text;
+  while (ok) {
+    SKIP_WS(str);
+    if (*str == '\0') break;
+    uint32_t index, prepared;
+    if (!read_value(&str, &index, 0)) {
+      printf("failed reading %s at: %.40s\n", path, str);
+      ok = 0;
+    } else if ((prepared = prepare_toplevel(index)) == 0) {
+      ok = 0;
+    } else {
+      if (fasl) fasl_add(fasl, prepared);
+      if (!eval_prepared(prepared)) ok = 0;
     }
-    
-    dump_value(res, 0); printf("\n");
   }
-  return 0;
+  if (fasl) fasl_end(fasl, path, ok);
+  free(text);
+  return ok;
 }
 
+/* Sets up the heap and everything else the interpreter needs before it
+   reads its first form. */
+void init_sketch(uint64_t heap_initial, uint64_t heap_max, int hugepages) {
+  heap_init(heap_initial, heap_max, hugepages);
+  init_cells();
+  init_reader();
+  init_symbols();
+  add_symbol_table();  /* for the global environment */
+  gc_add_visitor(visit_globals);
+  gc_add_visitor(visit_args);
+  gc_add_global(&lambda_name);
+  register_builtins();
+}
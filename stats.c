@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Runtime statistics: what the interpreter allocates and calls. The
+   collector keeps its own totals, which are always there; the rest are
+   counters bumped with STAT(), see common.h. */
+
+#if STATS
+struct stats stats;
+#endif
+
+static const char *type_names[TYPE_MASK+1] = {
+  [T_NONE] = "none", [T_INT32] = "integer", [T_PAIR] = "pair",
+  [T_STR] = "string", [T_SYM] = "symbol", [T_RESV] = "reserved",
+  [T_FUNC] = "function", [T_VECT] = "vector", [T_CHAR] = "char",
+  [T_VAR] = "variable", [T_SPECIAL] = "special", [T_CODE] = "code",
+  [T_BIG] = "bignum", [T_FLO] = "flonum", [T_NVEC] = "numeric vector",
+  [T_BUILDER] = "string builder",
+};
+
+const char *type_name(uint32_t type) {
+  if (type > TYPE_MASK || type_names[type] == 0) return "unknown";
+  return type_names[type];
+}
+
+/* for --stats and SKETCH_STATS; the committed heap never shrinks, so
+   it's the peak */
+void print_stats(void) {
+  fprintf(stderr, "cells allocated: %llu\n"
+                  "collections: %llu\n"
+                  "peak heap: %llu bytes\n"
+                  "simd kernels: %s\n",
+          (unsigned long long)gc_cells_allocated(),
+          (unsigned long long)gc_count,
+          (unsigned long long)(heap_size*sizeof(uint64_t)), simd_name());
+#if STATS
+  for (uint32_t i = 0; i <= TYPE_MASK; i++) {
+    if (stats.cells[i])
+      fprintf(stderr, "  %s cells: %llu\n", type_name(i),
+              (unsigned long long)stats.cells[i]);
+  }
+  fprintf(stderr, "lambda calls: %llu\n"
+                  "frame hops: %llu\n"
+                  "max eval depth: %u\n"
+                  "max vm frames: %u\n",
+          (unsigned long long)stats.lambda_calls,
+          (unsigned long long)stats.frame_hops,
+          stats.max_eval_depth, stats.max_vm_frames);
+  for (uint32_t i = 0; i < builtin_count(); i++) {
+    if (stats.builtin_calls[i])
+      fprintf(stderr, "  %s calls: %llu\n", builtin_name(i),
+              (unsigned long long)stats.builtin_calls[i]);
+  }
+#endif
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE  /* for memmem() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Strings. The bytes are in the cells after the header, STR_LEN() of
+   them, so everything here is memcpy(), memcmp(), memchr() and memmem()
+   over STR_START(), which the C library does with SIMD where the
+   processor has it.
+
+   Nothing is quadratic: string-append allocates its result once, and
+   a string builder appends into a buffer that doubles when it fills
+   up, then copies what it has into a string of its own at the end. */
+
+/* 0 if k isn't a position in str: an index, or with end set, the end */
+static int str_index(uint32_t str, uint32_t k, int end, uint32_t *index) {
+  if (TYPE(k) != T_INT32 || INT32_VALUE(k) < 0 ||
+      (uint64_t)INT32_VALUE(k) + !end > STR_LEN(str))
+    return 0;
+  *index = INT32_VALUE(k);
+  return 1;
+}
+
+uint32_t string_length(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_STR) return 0;
+  return store_int32(STR_LEN(args[0]));
+}
+
+uint32_t string_ref(const uint32_t *args, uint32_t nargs) {
+  uint32_t k;
+  if (TYPE(args[0]) != T_STR || !str_index(args[0], args[1], 0, &k))
+    return 0;
+  return MAKE_CHAR((unsigned char)STR_START(args[0])[k]);
+}
+
+/* (substring s start end) */
+uint32_t substring(const uint32_t *args, uint32_t nargs) {
+  uint32_t start, end;
+  if (TYPE(args[0]) != T_STR || !str_index(args[0], args[1], 1, &start) ||
+      !str_index(args[0], args[2], 1, &end) || start > end)
+    return 0;
+  uint32_t res = make_string(end - start, T_STR);
+  memcpy(STR_START(res), STR_START(args[0]) + start, end - start);
+  return res;
+}
+
+uint32_t string_append(const uint32_t *args, uint32_t nargs) {
+  uint64_t size = 0;
+  for (uint32_t i = 0; i < nargs; i++) {
+    if (TYPE(args[i]) != T_STR) return 0;
+    size += STR_LEN(args[i]);
+  }
+  if (size > MAX_STRING) return 0;
+  uint32_t res = make_string(size, T_STR);
+  char *p = STR_START(res);
+  for (uint32_t i = 0; i < nargs; i++) {
+    memcpy(p, STR_START(args[i]), STR_LEN(args[i]));
+    p += STR_LEN(args[i]);
+  }
+  return res;
+}
+
+/* like memcmp(): below, at or above zero as a sorts before, with or
+   after b; byte by byte, and a prefix first */
+static int compare_strings(uint32_t a, uint32_t b) {
+  uint32_t alen = STR_LEN(a), blen = STR_LEN(b);
+  int res = memcmp(STR_START(a), STR_START(b), alen < blen ? alen : blen);
+  if (res != 0) return res;
+  return (alen > blen) - (alen < blen);
+}
+
+/* each argument against the next */
+static uint32_t compare_all(const uint32_t *args, uint32_t nargs, int less) {
+  uint32_t res = C_TRUE;
+  for (uint32_t i = 0; i < nargs; i++)
+    if (TYPE(args[i]) != T_STR) return 0;
+  for (uint32_t i = 0; i+1 < nargs && res == C_TRUE; i++) {
+    if (less) {
+      if (compare_strings(args[i], args[i+1]) >= 0) res = C_FALSE;
+    } else if (STR_LEN(args[i]) != STR_LEN(args[i+1]) ||
+               memcmp(STR_START(args[i]), STR_START(args[i+1]),
+                      STR_LEN(args[i])) != 0) {
+      res = C_FALSE;
+    }
+  }
+  return res;
+}
+
+uint32_t string_equal(const uint32_t *args, uint32_t nargs) {
+  return compare_all(args, nargs, 0);
+}
+
+uint32_t string_less(const uint32_t *args, uint32_t nargs) {
+  return compare_all(args, nargs, 1);
+}
+
+/* (string-index s char [start]): where char first is, from start on,
+   or #f */
+uint32_t string_index(const uint32_t *args, uint32_t nargs) {
+  uint32_t str = args[0], start = 0;
+  if (TYPE(str) != T_STR || TYPE(args[1]) != T_CHAR) return 0;
+  if (nargs > 2 && !str_index(str, args[2], 1, &start)) return 0;
+  char *p = memchr(STR_START(str) + start, CHAR_VALUE(args[1]),
+                   STR_LEN(str) - start);
+  return p ? store_int32(p - STR_START(str)) : C_FALSE;
+}
+
+/* (string-contains s pattern [start]): the same for a string */
+uint32_t string_contains(const uint32_t *args, uint32_t nargs) {
+  uint32_t str = args[0], pattern = args[1], start = 0;
+  if (TYPE(str) != T_STR || TYPE(pattern) != T_STR) return 0;
+  if (nargs > 2 && !str_index(str, args[2], 1, &start)) return 0;
+  char *p = memmem(STR_START(str) + start, STR_LEN(str) - start,
+                   STR_START(pattern), STR_LEN(pattern));
+  return p ? store_int32(p - STR_START(str)) : C_FALSE;
+}
+
+/* String builders. */
+
+uint32_t make_string_builder(const uint32_t *args, uint32_t nargs) {
+  CHECK_CELLS(2);
+  STAT(stats.cells[T_BUILDER] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_STRING, 2);
+  uint32_t index = next_cell;
+  cells[next_cell++] = T_BUILDER;
+  cells[next_cell++] = 0;  /* no buffer yet */
+  return index;
+}
+
+uint32_t string_builder_p(const uint32_t *args, uint32_t nargs) {
+  return TYPE(args[0]) == T_BUILDER ? C_TRUE : C_FALSE;
+}
+
+/* (string-builder-append! sb x ...), each x a string or a char */
+uint32_t string_builder_append(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_BUILDER) return 0;
+  uint64_t size = BUILDER_USED(args[0]);
+  for (uint32_t i = 1; i < nargs; i++) {
+    if (TYPE(args[i]) == T_CHAR) size++;
+    else if (TYPE(args[i]) == T_STR) size += STR_LEN(args[i]);
+    else return 0;
+  }
+  if (size > MAX_STRING) return 0;
+
+  uint32_t used = BUILDER_USED(args[0]), buffer = BUILDER_BUFFER(args[0]);
+  if (buffer == 0 || size > STR_LEN(buffer)) {
+    uint64_t room = buffer ? 2*STR_LEN(buffer) : 32;
+    if (room < size) room = size;
+    if (room > MAX_STRING) room = MAX_STRING;
+    buffer = make_string(room, T_STR);
+    /* the old buffer may have moved */
+    if (used) memcpy(STR_START(buffer), STR_START(BUILDER_BUFFER(args[0])),
+                     used);
+    SET_CDR(args[0], buffer);
+  }
+  char *p = STR_START(buffer) + used;
+  for (uint32_t i = 1; i < nargs; i++) {
+    if (TYPE(args[i]) == T_CHAR) {
+      *p++ = CHAR_VALUE(args[i]);
+    } else {
+      memcpy(p, STR_START(args[i]), STR_LEN(args[i]));
+      p += STR_LEN(args[i]);
+    }
+  }
+  cells[args[0]] = T_BUILDER | size << 32;
+  return C_UNSPEC;
+}
+
+uint32_t string_builder_length(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_BUILDER) return 0;
+  return store_int32(BUILDER_USED(args[0]));
+}
+
+/* a new string with what's been appended so far */
+uint32_t string_builder_string(const uint32_t *args, uint32_t nargs) {
+  if (TYPE(args[0]) != T_BUILDER) return 0;
+  uint32_t used = BUILDER_USED(args[0]);
+  uint32_t res = make_string(used, T_STR);
+  if (used)
+    memcpy(STR_START(res), STR_START(BUILDER_BUFFER(args[0])), used);
+  return res;
+}
+
+void register_string_builtins(void) {
+  register_builtin("string-length", string_length, 1, 1);
+  register_builtin("string-ref", string_ref, 2, 2);
+  register_builtin("substring", substring, 3, 3);
+  register_builtin("string-append", string_append, 0, ANY_ARGS);
+  register_builtin("string=?", string_equal, 1, ANY_ARGS);
+  register_builtin("string<?", string_less, 1, ANY_ARGS);
+  register_builtin("string-index", string_index, 2, 3);
+  register_builtin("string-contains", string_contains, 2, 3);
+
+  register_builtin("make-string-builder", make_string_builder, 0, 0);
+  register_builtin("string-builder?", string_builder_p, 1, 1);
+  register_builtin("string-builder-append!", string_builder_append, 1,
+                   ANY_ARGS);
+  register_builtin("string-builder-length", string_builder_length, 1, 1);
+  register_builtin("string-builder->string", string_builder_string, 1, 1);
+}
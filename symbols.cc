@@ -1,74 +1,262 @@
 #include <stdint.h>
-#include <string>
-#include <list>
-#include <tr1/unordered_map>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 using namespace std;
 
-extern "C" void die(char *msg);
-
-extern "C" int find_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame);
-extern "C" void add_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame);
-extern "C" void add_symbol_table();
-extern "C" void delete_symbol_table();
-extern "C" uint32_t latest_table_size();
+extern "C" {
+#include "common.h"
+}
 
 void cpp_die(const char *msg) {
   die(const_cast<char *>(msg));
 }
 
-string sym_name(const char* name, int len) {
-  string str;
-  str.assign(name, len);
-  return str;
+/* Names. Every name the reader or a builtin ever mentions is stored
+   once, in an arena, and known by its position in names[] from then on.
+   Looking a name up takes a pointer and a length, hashes them, and
+   probes an open-addressed index; nothing is allocated unless the name
+   is new. */
+
+#define NONE 0xFFFFFFFF
+
+struct name_entry {
+  uint32_t hash;
+  uint32_t offset, len;  /* in name_arena */
+  uint32_t binding;      /* innermost binding in bindings[], or NONE */
+};
+
+vector<name_entry> names;
+vector<char> name_arena;
+vector<uint32_t> name_index;  /* 0 for empty, else position in names + 1 */
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name, int len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void grow_name_index() {
+  uint32_t size = name_index.size() ? name_index.size()*2 : 1024;
+  name_index.assign(size, 0);
+  for (uint32_t i = 0; i < names.size(); i++) {
+    uint32_t pos = names[i].hash & (size-1);
+    while (name_index[pos]) pos = (pos+1) & (size-1);
+    name_index[pos] = i+1;
+  }
 }
 
-struct symbol_table {
-  uint32_t next;
-  tr1::unordered_map<string, uint32_t> table;
+/* position of the name in names[], or NONE if it's new and add is false */
+static uint32_t find_name(const char *name, int len, bool add) {
+  if (name_index.size() == 0) grow_name_index();
+  uint32_t hash = hash_name(name, len);
+  uint32_t mask = name_index.size()-1, pos = hash & mask;
+  while (name_index[pos]) {
+    name_entry &e = names[name_index[pos]-1];
+    if (e.hash == hash && e.len == (uint32_t)len &&
+        memcmp(&name_arena[e.offset], name, len) == 0)
+      return name_index[pos]-1;
+    pos = (pos+1) & mask;
+  }
+  if (!add) return NONE;
+
+  name_entry e;
+  e.hash = hash; e.offset = name_arena.size(); e.len = len;
+  e.binding = NONE;
+  name_arena.insert(name_arena.end(), name, name+len);
+  names.push_back(e);
+  name_index[pos] = names.size();
+  if (names.size()*2 > name_index.size()) grow_name_index();
+  return names.size()-1;
+}
+
+/* Lexical scopes. There's one scope per symbol table: the global one,
+   then one for each lambda being prepared. A binding of a name to a slot
+   is pushed on a single stack as its scope declares it, and linked to
+   the name's previous binding, which it shadows. So a name's innermost
+   binding is always at hand, and deleting a scope just pops its
+   bindings. */
+
+struct binding {
+  uint32_t name;
+  uint32_t scope, slot;
+  uint32_t prev;  /* the binding this one shadows, or NONE */
 };
 
-list<symbol_table> tables;
+struct scope {
+  uint32_t next;           /* next free slot */
+  uint32_t first_binding;  /* where this scope's bindings start */
+};
+
+vector<binding> bindings;
+vector<scope> scopes;
+
+/* the name of each slot in globals[], for turning a global variable
+   back into its name (see fasl.c) */
+vector<uint32_t> global_names;
+
+static void name_global(uint32_t slot, uint32_t name) {
+  if (global_names.size() <= slot) global_names.resize(slot+1, NONE);
+  global_names[slot] = name;
+}
 
+/* A lambda's environment starts with its display, one slot per lambda
+   it's nested in (see init_display()), so its own variables start after
+   that. The global scope numbers its slots in globals[] from 0. */
 void add_symbol_table() {
-  symbol_table st;
-  st.next = 1;
-  tables.push_front(st);
+  scope s;
+  s.next = scopes.size() > 0 ? scopes.size()-1 : 0;
+  s.first_binding = bindings.size();
+  scopes.push_back(s);
 }
 
 void delete_symbol_table() {
-  if (tables.size() == 0) cpp_die("no symbol tables, can't delete one");
-  tables.pop_front();
+  if (scopes.size() == 0) cpp_die("no symbol tables, can't delete one");
+  uint32_t first = scopes.back().first_binding;
+  for (uint32_t i = bindings.size(); i > first; i--)
+    names[bindings[i-1].name].binding = bindings[i-1].prev;
+  bindings.resize(first);
+  scopes.pop_back();
 }
 
 int find_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame) {
-  string str = sym_name(name, len);
-  int pos = 0;
-  for (list<symbol_table>::iterator it = tables.begin();
-       it != tables.end(); ++it, ++pos) {
-    if (it->table.find(str) != it->table.end()) {
-      *slot = it->table[str];
-      *frame = pos;
-      return 1;
-    }
-  }
-  return 0;
+  uint32_t pos = find_name(name, len, false);
+  if (pos == NONE || names[pos].binding == NONE) return 0;
+  binding &b = bindings[names[pos].binding];
+  *slot = b.slot;
+  *frame = b.scope == 0 ? GLOBAL_FRAME : scopes.size()-1 - b.scope;
+  return 1;
 }
 
 void add_symbol(const char *name, int len, uint32_t *slot, uint32_t *frame) {
-  if (tables.size() == 0) cpp_die("no symbol tables, can't add a symbol");
-  string str = sym_name(name, len);
-  symbol_table& st = tables.front();
-  if (st.table.find(str) != st.table.end()) {
-    *slot = st.table[str];
+  if (scopes.size() == 0) cpp_die("no symbol tables, can't add a symbol");
+  uint32_t pos = find_name(name, len, true);
+  uint32_t current = scopes.size()-1;
+  uint32_t top = names[pos].binding;
+  if (top != NONE && bindings[top].scope == current) {
+    *slot = bindings[top].slot;
   } else {
-    *slot = st.next;
-    st.table[str] = st.next++;
+    binding b;
+    b.name = pos; b.scope = current; b.slot = scopes.back().next++;
+    b.prev = top;
+    names[pos].binding = bindings.size();
+    bindings.push_back(b);
+    *slot = b.slot;
+    if (current == 0) name_global(b.slot, pos);
   }
-  *frame = 0;
+  *frame = current == 0 ? GLOBAL_FRAME : 0;
 }
 
 uint32_t latest_table_size() {
-  return tables.front().next-1;
+  return scopes.back().next;
+}
+
+/* Interned symbols: one T_SYM cell per name, so symbols can be compared
+   by index. The cells are kept alongside names[], in a vector the
+   garbage collector treats as a root, and it updates the indices there
+   when they move. Names never interned as symbols have 0 there, which
+   the collector ignores. */
+
+vector<uint32_t> symbol_cells;
+
+uint32_t intern_symbol(const char *name, int len) {
+  uint32_t pos = find_name(name, len, true);
+  if (symbol_cells.size() < names.size()) symbol_cells.resize(names.size(), 0);
+  if (symbol_cells[pos]) return symbol_cells[pos];
+  /* copy from the arena: name could be in the heap, and storing the
+     string may collect */
+  char *start = &name_arena[names[pos].offset];
+  uint32_t index = store_string(start, start + len, T_SYM);
+  symbol_cells[pos] = index;
+  return index;
 }
 
+uint32_t *interned_symbols(uint32_t *count) {
+  *count = symbol_cells.size();
+  return symbol_cells.data();
+}
+
+/* Images (see image.c) carry all of the above as it stands, so that a
+   loaded image can go on defining and interning where the saved one
+   left off. The tables are written one after the other, after their
+   sizes. */
+
+struct table_sizes {
+  uint32_t names, arena, index, bindings, scopes, symbols;
+};
+
+template <class T>
+static char *put_table(char *p, const vector<T> &v) {
+  memcpy(p, v.data(), v.size()*sizeof(T));
+  return p + v.size()*sizeof(T);
+}
+
+template <class T>
+static const char *get_table(const char *p, vector<T> &v, uint32_t size) {
+  v.resize(size);
+  memcpy(v.data(), p, size*sizeof(T));
+  return p + size*sizeof(T);
+}
+
+void *save_symbols(size_t *size) {
+  table_sizes sizes;
+  sizes.names = names.size(); sizes.arena = name_arena.size();
+  sizes.index = name_index.size(); sizes.bindings = bindings.size();
+  sizes.scopes = scopes.size(); sizes.symbols = symbol_cells.size();
+  *size = sizeof(sizes) + names.size()*sizeof(name_entry) +
+          name_arena.size() + name_index.size()*sizeof(uint32_t) +
+          bindings.size()*sizeof(binding) + scopes.size()*sizeof(scope) +
+          symbol_cells.size()*sizeof(uint32_t);
+  char *data = (char *)malloc(*size);
+  if (data == 0) cpp_die("couldn't alloc memory for the symbol tables");
+  memcpy(data, &sizes, sizeof(sizes));
+  char *p = data + sizeof(sizes);
+  p = put_table(p, names);
+  p = put_table(p, name_arena);
+  p = put_table(p, name_index);
+  p = put_table(p, bindings);
+  p = put_table(p, scopes);
+  put_table(p, symbol_cells);
+  return data;
+}
+
+/* replaces the tables with saved ones; 0 if the data doesn't add up */
+int load_symbols(const void *data, size_t size) {
+  table_sizes sizes;
+  if (size < sizeof(sizes)) return 0;
+  memcpy(&sizes, data, sizeof(sizes));
+  if (size != sizeof(sizes) + sizes.names*sizeof(name_entry) +
+              sizes.arena + sizes.index*sizeof(uint32_t) +
+              sizes.bindings*sizeof(binding) + sizes.scopes*sizeof(scope) +
+              sizes.symbols*sizeof(uint32_t))
+    return 0;
+  const char *p = (const char *)data + sizeof(sizes);
+  p = get_table(p, names, sizes.names);
+  p = get_table(p, name_arena, sizes.arena);
+  p = get_table(p, name_index, sizes.index);
+  p = get_table(p, bindings, sizes.bindings);
+  p = get_table(p, scopes, sizes.scopes);
+  get_table(p, symbol_cells, sizes.symbols);
+  global_names.clear();
+  for (uint32_t i = 0; i < bindings.size(); i++)
+    if (bindings[i].scope == 0) name_global(bindings[i].slot, bindings[i].name);
+  return 1;
+}
+
+int global_name(uint32_t slot, const char **name, int *len) {
+  if (slot >= global_names.size() || global_names[slot] == NONE) return 0;
+  name_entry &e = names[global_names[slot]];
+  *name = &name_arena[e.offset];
+  *len = e.len;
+  return 1;
+}
+
+/* slots taken in globals[] */
+uint32_t global_slots() {
+  return scopes.size() ? scopes[0].next : 0;
+}
@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* A compiler from prepared forms to bytecode, and a stack machine that
+   runs it. prepare() has already resolved variables to lexical addresses
+   and special forms to T_SPECIAL, so compiling is one walk over the form
+   that lays it out linearly. The machine keeps its own stack of frames,
+   so calls from one lambda to another don't recurse in C, and calls in
+   tail position replace the caller's frame rather than push a new one,
+   so tail-recursive loops run in constant space.
+
+   Bytecode lives in T_CODE values in the heap, so it can move during a
+   collection, just like everything else. The machine keeps only offsets
+   into it across anything that may allocate. */
+
+/* run everything through eval() instead; see --tree-walk in main() */
+int use_vm = 1;
+
+enum {
+  OP_IMM,      /* value: push a value that never moves, e.g. #t or () */
+  OP_CONST,    /* k: push constant number k */
+  OP_LOCAL,    /* slot: push a variable from the current frame */
+  OP_VAR,      /* frame slot: push a variable from an enclosing frame */
+  OP_GLOBAL,   /* slot: push a global variable */
+  OP_SET,      /* frame slot: store the top of the stack in a variable,
+                  and replace it with the unspecified value */
+  OP_SETGLOBAL, /* slot: same, for a global variable */
+  OP_POP,
+  OP_JUMP,     /* target */
+  OP_JUMPF,    /* target: pop, and jump if it was #f */
+  OP_CLOSURE,  /* k: push a closure of the lambda in constant k */
+  OP_CALL,     /* n: call the function below the top n values */
+  OP_TAILCALL, /* n: same, reusing the current frame */
+  OP_PRIM,     /* form 2: a primitive (see C_ADD) on the top two values;
+                  if it can't be done inline, a call of its global */
+  OP_RETURN,
+  NUM_OPS
+};
+
+/* The compiler. */
+
+struct compiler {
+  uint32_t *words;
+  uint32_t num_words, max_words;
+  uint32_t *consts;
+  uint32_t num_consts, max_consts;
+  uint32_t consts_root;  /* where consts is among the gc roots */
+  uint32_t depth, max_depth;
+};
+
+static void emit(struct compiler *c, uint32_t word) {
+  if (c->num_words == c->max_words) {
+    c->max_words = c->max_words ? c->max_words*2 : 32;
+    c->words = realloc(c->words, c->max_words*sizeof(uint32_t));
+    if (c->words == 0) die("couldn't alloc memory for bytecode");
+  }
+  c->words[c->num_words++] = word;
+}
+
+static uint32_t add_const(struct compiler *c, uint32_t value) {
+  for (uint32_t i = 0; i < c->num_consts; i++)
+    if (c->consts[i] == value) return i;
+  if (c->num_consts == c->max_consts) {
+    c->max_consts = c->max_consts ? c->max_consts*2 : 8;
+    c->consts = realloc(c->consts, c->max_consts*sizeof(uint32_t));
+    if (c->consts == 0) die("couldn't alloc memory for constants");
+    gc_roots[c->consts_root].ptr = c->consts;
+  }
+  c->consts[c->num_consts] = value;
+  gc_roots[c->consts_root].count = ++c->num_consts;
+  return c->num_consts-1;
+}
+
+static void stack_effect(struct compiler *c, int delta) {
+  c->depth += delta;
+  if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+static void emit_value(struct compiler *c, uint32_t value) {
+  if (value < C_STARTFROM || IMMEDIATE(value)) {
+    emit(c, OP_IMM); emit(c, value);
+  } else {
+    emit(c, OP_CONST); emit(c, add_const(c, value));
+  }
+  stack_effect(c, 1);
+}
+
+/* Compiles code that leaves the value of form on the stack. If tail is
+   true, form is in tail position and nothing is on the stack below it.
+   Nothing in here allocates cells, so form and everything in it stay put. */
+static void compile_form(struct compiler *c, uint32_t form, int tail) {
+  uint32_t func, args, var, count, else_jump, end_jump;
+  switch(TYPE(form)) {
+    case T_SYM:
+      die("compile: should not get a naked symbol");
+    case T_VAR:
+      if (VAR_FRAME(form) == GLOBAL_FRAME) {
+        emit(c, OP_GLOBAL); emit(c, VAR_SLOT(form));
+      } else if (VAR_FRAME(form) == 0) {
+        emit(c, OP_LOCAL); emit(c, VAR_SLOT(form));
+      } else {
+        emit(c, OP_VAR); emit(c, VAR_FRAME(form)); emit(c, VAR_SLOT(form));
+      }
+      stack_effect(c, 1);
+      break;
+    case T_FUNC:
+      /* a lambda form, to be closed over the current environment */
+      emit(c, OP_CLOSURE); emit(c, add_const(c, form));
+      stack_effect(c, 1);
+      break;
+    case T_PAIR:
+      func = CAR(form);
+      args = CDR(form);
+      if (TYPE(func) == T_SPECIAL) {
+        switch (SPECIAL_FORM(func)) {
+          case F_DEFINE:
+          case F_SET:
+            compile_form(c, CAR(CDR(args)), 0);
+            var = CAR(args);
+            if (VAR_FRAME(var) == GLOBAL_FRAME) {
+              emit(c, OP_SETGLOBAL); emit(c, VAR_SLOT(var));
+            } else {
+              emit(c, OP_SET); emit(c, VAR_FRAME(var)); emit(c, VAR_SLOT(var));
+            }
+            break;
+          case F_QUOTE:
+            emit_value(c, CAR(args));
+            break;
+          case F_IF:
+            compile_form(c, CAR(args), 0);
+            emit(c, OP_JUMPF); emit(c, 0);
+            else_jump = c->num_words-1;
+            stack_effect(c, -1);
+            compile_form(c, CAR(CDR(args)), tail);
+            emit(c, OP_JUMP); emit(c, 0);
+            end_jump = c->num_words-1;
+            c->words[else_jump] = c->num_words;
+            stack_effect(c, -1);  /* only one of the branches runs */
+            args = CDR(CDR(args));
+            if (args != C_EMPTY) compile_form(c, CAR(args), tail);
+            else emit_value(c, C_UNSPEC);
+            c->words[end_jump] = c->num_words;
+            break;
+          default:
+            compile_form(c, CAR(args), 0);
+            compile_form(c, CAR(CDR(args)), 0);
+            emit(c, OP_PRIM); emit(c, SPECIAL_FORM(func)); emit(c, 2);
+            stack_effect(c, 1);  /* the function, if it comes to a call */
+            stack_effect(c, -2);
+            break;
+        }
+        break;
+      }
+      /* an application */
+      compile_form(c, func, 0);
+      for (count = 0; args != C_EMPTY; args = CDR(args), count++)
+        compile_form(c, CAR(args), 0);
+      if (count >= MAX_ARGS) die("more than MAX_ARGS arguments");
+      emit(c, tail ? OP_TAILCALL : OP_CALL); emit(c, count);
+      stack_effect(c, -(int)count);
+      break;
+    default:  /* self-evaluating */
+      emit_value(c, form);
+      break;
+  }
+}
+
+static void start_compiler(struct compiler *c) {
+  memset(c, 0, sizeof(*c));
+  c->consts_root = gc_num_roots;
+  GC_ROOTS(c->consts, 0);
+}
+
+/* Stores the compiled code in the heap, and cleans up. */
+static uint32_t finish_compiler(struct compiler *c, uint32_t source) {
+  emit(c, OP_RETURN);
+  if (c->max_depth > 0xFFFF) die("compile: expression too deep");
+  GC_ROOT(source);
+  uint32_t consts = make_vector(c->num_consts, 0);
+  if (c->num_consts)
+    memcpy(VECTOR_START(consts), c->consts, c->num_consts*sizeof(uint32_t));
+  GC_ROOT(consts);
+
+  uint32_t len = c->num_words;
+  uint32_t size = CELLS_EVEN(2 + (len+1)/2);
+  CHECK_CELLS(size);
+  STAT(stats.cells[T_CODE] += size);
+  if (alloc_profiling) profile_alloc(ALLOC_CODE, size);
+  uint32_t index = next_cell;
+  cells[index] = T_CODE | (uint64_t)c->max_depth << 16 | (uint64_t)len << 32;
+  cells[index+1] = (uint64_t)consts << 32 | source;
+  cells[index+size-1] = 0;  /* the padding, if any */
+  memcpy(CODE_START(index), c->words, len*sizeof(uint32_t));
+  next_cell += size;
+
+  gc_num_roots = c->consts_root;
+  free(c->words);
+  free(c->consts);
+  return index;
+}
+
+/* compiles a lambda body: a list of forms, the last one's value returned */
+uint32_t compile_body(uint32_t body) {
+  struct compiler c;
+  start_compiler(&c);
+  if (body == C_EMPTY) emit_value(&c, C_UNSPEC);
+  for (uint32_t list = body; list != C_EMPTY; list = CDR(list)) {
+    compile_form(&c, CAR(list), CDR(list) == C_EMPTY);
+    if (CDR(list) != C_EMPTY) {
+      emit(&c, OP_POP);
+      stack_effect(&c, -1);
+    }
+  }
+  return finish_compiler(&c, body);
+}
+
+uint32_t compile_toplevel(uint32_t form) {
+  struct compiler c;
+  start_compiler(&c);
+  compile_form(&c, form, 1);
+  return finish_compiler(&c, form);
+}
+
+/* The machine. Its value stack and frame stack are plain arrays that
+   grow as needed; nothing keeps a pointer into them across a call that
+   could grow them, only offsets. */
+
+#define MAX_STACK (1 << 28)
+#define MAX_FRAMES (1 << 26)
+
+/* A suspended caller. The code and env of the running function are
+   parked here too whenever it does something that may allocate. */
+struct frame {
+  uint32_t code, env;
+  uint32_t pc;  /* offset into the code */
+};
+
+static uint32_t *stack;
+static uint32_t stack_top, stack_size;  /* top is current whenever we
+                                           may allocate */
+static struct frame *frames;
+static uint32_t num_frames, max_frames;
+
+static void visit_vm(void (*visit)(uint32_t *)) {
+  for (uint32_t i = 0; i < stack_top; i++) visit(&stack[i]);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    visit(&frames[i].code);
+    visit(&frames[i].env);
+  }
+}
+
+/* makes room for at least count values above top */
+static void grow_stack(uint32_t top, uint32_t count) {
+  while (top + count > stack_size) {
+    stack_size = stack_size ? stack_size*2 : 1 << 16;
+    if (stack_size > MAX_STACK) die("vm stack overflow");
+  }
+  stack = realloc(stack, stack_size*sizeof(uint32_t));
+  if (stack == 0) die("couldn't alloc memory for the vm stack");
+}
+
+static void grow_frames(void) {
+  max_frames = max_frames ? max_frames*2 : 1 << 12;
+  if (max_frames > MAX_FRAMES) die("too many nested calls");
+  frames = realloc(frames, max_frames*sizeof(struct frame));
+  if (frames == 0) die("couldn't alloc memory for vm frames");
+}
+
+uint32_t vm_run(uint32_t code, uint32_t env) {
+  static void *dispatch[NUM_OPS] = {
+    [OP_IMM] = &&op_imm, [OP_CONST] = &&op_const, [OP_LOCAL] = &&op_local,
+    [OP_VAR] = &&op_var, [OP_GLOBAL] = &&op_global, [OP_SET] = &&op_set,
+    [OP_SETGLOBAL] = &&op_setglobal, [OP_POP] = &&op_pop,
+    [OP_JUMP] = &&op_jump, [OP_JUMPF] = &&op_jumpf,
+    [OP_CLOSURE] = &&op_closure, [OP_CALL] = &&op_call,
+    [OP_TAILCALL] = &&op_tailcall, [OP_PRIM] = &&op_prim,
+    [OP_RETURN] = &&op_return
+  };
+  uint32_t *ip, *consts, *sp;
+  uint32_t func, val, n;
+  int tail;
+
+  static int visiting = 0;
+  if (!visiting) { gc_add_visitor(visit_vm); visiting = 1; }
+  uint32_t base_frames = num_frames, base_stack = stack_top;
+  uint32_t base_frame_top = frame_top, base_profile = profile_top;
+  sp = stack + stack_top;
+
+#define ENTER(new_code) do { code = (new_code); \
+    if (sp + CODE_MAXSTACK(code) > stack + stack_size) { \
+      uint32_t top = sp - stack; \
+      grow_stack(top, CODE_MAXSTACK(code)); \
+      sp = stack + top; \
+    } \
+    ip = CODE_START(code); consts = VECTOR_START(CODE_CONSTS(code)); \
+  } while(0)
+
+#define PUSH_FRAME() do { \
+    if (num_frames == max_frames) grow_frames(); \
+    frames[num_frames].code = code; frames[num_frames].env = env; \
+    frames[num_frames++].pc = ip - CODE_START(code); } while(0)
+
+#define POP_FRAME() do { --num_frames; \
+    code = frames[num_frames].code; env = frames[num_frames].env; \
+    ip = CODE_START(code) + frames[num_frames].pc; \
+    consts = VECTOR_START(CODE_CONSTS(code)); } while(0)
+
+/* Around anything that may allocate. A builtin may run the machine
+   again, growing the stack, so sp is recomputed afterwards. */
+#define SAVE_REGS() do { PUSH_FRAME(); stack_top = sp - stack; } while(0)
+#define RESTORE_REGS() do { POP_FRAME(); sp = stack + stack_top; } while(0)
+
+#define NEXT goto *dispatch[*ip++]
+
+  ENTER(code);
+  NEXT;
+
+op_imm:
+  *sp++ = *ip++;
+  NEXT;
+op_const:
+  *sp++ = consts[*ip++];
+  NEXT;
+op_local:
+  *sp++ = VECTOR_START(env)[*ip++];
+  NEXT;
+op_var:
+  STAT(stats.frame_hops++);
+  val = VECTOR_START(env)[ip[0]-1];  /* the display, see init_display() */
+  *sp++ = VECTOR_START(val)[ip[1]];
+  ip += 2;
+  NEXT;
+op_global:
+  val = globals[*ip++];
+  if (val == 0) {
+    undefined_global(ip[-1]);
+    goto fail;
+  }
+  *sp++ = val;
+  NEXT;
+op_set:
+  val = follow_frame(env, ip[0]);
+  store_env(val, ip[1], sp[-1]);
+  sp[-1] = C_UNSPEC;
+  ip += 2;
+  NEXT;
+op_setglobal:
+  globals[*ip++] = sp[-1];
+  sp[-1] = C_UNSPEC;
+  NEXT;
+op_pop:
+  sp--;
+  NEXT;
+op_jump:
+  ip = CODE_START(code) + *ip;
+  NEXT;
+op_jumpf:
+  if (*--sp == C_FALSE) ip = CODE_START(code) + *ip;
+  else ip++;
+  NEXT;
+op_closure:
+  SAVE_REGS();
+  CHECK_CELLS(2);
+  RESTORE_REGS();
+  func = consts[*ip++];
+  STAT(stats.cells[T_FUNC] += 2);
+  if (alloc_profiling) profile_alloc(ALLOC_CLOSURE, 2);
+  val = next_cell;
+  cells[next_cell++] = cells[func];
+  cells[next_cell++] = cells[func+1];
+  SET_CAR(val, env);
+  *sp++ = val;
+  NEXT;
+op_prim:
+  if (primitive_intact(*ip) && fixnum_primitive(*ip, sp[-2], sp[-1], &val)) {
+    ip += 2;
+    sp--;
+    sp[-1] = val;
+    NEXT;
+  }
+  /* slide the arguments up for the function, and call it */
+  sp[0] = sp[-1];
+  sp[-1] = sp[-2];
+  sp[-2] = globals[primitive_slot(*ip++)];
+  sp++;
+  tail = 0;
+  goto call;
+op_tailcall:
+  tail = 1;
+  goto call;
+op_call:
+  tail = 0;
+call:
+  n = *ip++;
+  func = *(sp-n-1);
+  if (TYPE(func) != T_FUNC) die("first element in list not a function");
+  if (cells[func] & BLTIN_MASK) {
+    if (!BLTIN_ARGS_OK(func, n)) {
+      printf("eval: number of args mismatch.\n");
+      goto fail;
+    }
+    STAT(stats.builtin_calls[BLTIN_ID(func)]++);
+    if (profiling) profile_builtin(BLTIN_ID(func));
+    SAVE_REGS();
+    val = ((builtin_t)cells[func+1])(stack+stack_top-n, n);
+    RESTORE_REGS();
+    if (profiling) profile_builtin_id = 0;
+    sp -= n+1;
+    if (val == 0) goto fail;
+    if (tail) goto do_return;
+    *sp++ = val;
+    NEXT;
+  }
+  if (n != FUNC_ARGCOUNT(func)) {
+    printf("eval: number of args mismatch.\n");
+    goto fail;
+  }
+  STAT(stats.lambda_calls++);
+  /* in a tail call, the current environment is dead if it's on the
+     frame stack, as nothing can have captured it */
+  if (tail && env >= frame_base) frame_top = env;
+  val = 0;
+  if (cells[func] & LEAF_MASK) val = make_frame_env(FUNC_VARCOUNT(func));
+  if (val == 0) {
+    SAVE_REGS();
+    val = make_env(FUNC_VARCOUNT(func));
+    RESTORE_REGS();
+    func = *(sp-n-1);  /* may have moved */
+  }
+  init_display(val, func);
+  memcpy(VECTOR_START(val)+FUNC_DISPLAY(func), sp-n, n*sizeof(uint32_t));
+  sp -= n+1;
+  /* in a tail call, the stack is now empty down to where the current
+     function started, and we just take its place */
+  if (!tail) PUSH_FRAME();
+  /* the profiler's stack has a lambda for each frame, and one more
+     once the code we started with has made a tail call */
+  if (profiling) {
+    if (tail && profile_top > base_profile) profile_tail_call(FUNC_BODY(func));
+    else profile_call(FUNC_BODY(func));
+  }
+  STAT(if (num_frames > stats.max_vm_frames) stats.max_vm_frames = num_frames);
+  env = val;
+  ENTER(FUNC_BODY(func));
+  NEXT;
+op_return:
+  val = *--sp;
+do_return:
+  if (env >= frame_base) frame_top = env;  /* pop it */
+  if (num_frames == base_frames) {
+    stack_top = sp - stack;
+    profile_top = base_profile;
+    return val;
+  }
+  if (profile_top > base_profile) profile_top--;
+  POP_FRAME();
+  *sp++ = val;
+  NEXT;
+
+fail:
+  frame_top = base_frame_top;
+  profile_top = base_profile;
+  num_frames = base_frames;
+  stack_top = base_stack;
+  return 0;
+}